@@ -6,7 +6,17 @@ static void show_help(const char *progname)
     printf("usage: %s [options] <mountpoint>\n\n", progname);
     printf("FileSystem Options: \n");
     printf("--name filename to store data\n");
-    printf("-ct create a new file to store data");
+    printf("-ct create a new file to store data\n");
+    printf("--mmap map the file into memory instead of loading it\n");
+    printf("--cache-mb=MB load clusters on demand, keeping at most MB of them in memory\n");
+    printf("--io=sync|uring engine for reading and writing the file (default: sync)\n");
+    printf("--io-threads=N threads loading the file in the background and splitting large writes (default: CPUs, at most 8)\n");
+    printf("--checkpoint-ms=MS write changes back every MS milliseconds (default: only on fsync/unmount)\n");
+    printf("--journal log metadata changes to FILE.journal before writing them in place\n");
+    printf("--snapshot=FILE on SIGUSR1, write a point-in-time copy of the volume to FILE without pausing writes\n");
+    printf("--size=MB volume size when creating (default: 256 clusters)\n");
+    printf("--cluster-size=BYTES cluster size when creating (default: 16384)\n");
+    printf("--root-entries=N root directory entries when creating (default: 512)\n");
 }
 
 #define OPTION(t, p)                           \
@@ -15,6 +25,16 @@ static void show_help(const char *progname)
 static const struct fuse_opt option_spec[] = {
         OPTION("-ct", is_create),
         OPTION("--name=%s", filename),
+        OPTION("--mmap", use_mmap),
+        OPTION("--cache-mb=%u", cache_mb),
+        OPTION("--io=%s", io_engine),
+        OPTION("--io-threads=%u", io_threads),
+        OPTION("--checkpoint-ms=%u", checkpoint_ms),
+        OPTION("--journal", journal),
+        OPTION("--snapshot=%s", snapshot),
+        OPTION("--size=%u", size_mb),
+        OPTION("--cluster-size=%u", cluster_size),
+        OPTION("--root-entries=%u", root_entries),
         OPTION("-h", show_help),
         OPTION("--help", show_help),
         FUSE_OPT_END
@@ -29,9 +49,14 @@ static const struct fuse_operations my_fat_ops = {
     .unlink = my_unlink,
     .read = my_read,
     .write = my_write,
+    .read_buf = my_read_buf,
+    .write_buf = my_write_buf,
     .flush = my_flush,
     .release = my_release,
+    .fsync = my_fsync,
     .truncate = my_truncate,
+    .fallocate = my_fallocate,
+    .copy_file_range = my_copy_file_range,
     .rename = my_rename,
     .chmod = my_chmod,
     .chown = my_chown,
@@ -0,0 +1,188 @@
+//
+// 空闲簇分配器
+//
+
+#include "my_alloc.h"
+#include "my_fat.h"
+
+#include <pthread.h>
+
+// 一个字能记录的簇数
+#define BITS_PER_WORD 64
+
+static uint64_t *g_free_map;        // 空闲簇位图，位为 1 表示该簇空闲
+static uint32_t g_map_words;        // 位图的字数
+static uint32_t g_cluster_end;      // 最大可用簇号 + 1
+static uint32_t g_free_count;       // 空闲簇数量
+static uint32_t g_cursor;           // 下次开始查找的字下标
+static pthread_mutex_t g_alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * 判断簇是否空闲
+ */
+static int is_free(uint32_t cluster_num)
+{
+    return (g_free_map[cluster_num / BITS_PER_WORD] >> (cluster_num % BITS_PER_WORD)) & 1;
+}
+
+/**
+ * 从 pos 开始查找第一个状态为 want 的簇
+ * @param pos 起始簇号
+ * @param want 1 表示查找空闲簇，0 表示查找已用簇
+ * @return 返回簇号，找不到则返回 g_cluster_end
+ */
+static uint32_t find_next(uint32_t pos, int want)
+{
+    while (pos < g_cluster_end) {
+        uint64_t word = g_free_map[pos / BITS_PER_WORD];
+        if (!want)
+            word = ~word;
+
+        word >>= pos % BITS_PER_WORD;
+        if (word != 0) {
+            pos += __builtin_ctzll(word);
+            break;
+        }
+
+        // 本字剩下的位都不满足，跳到下一个字
+        pos = (pos / BITS_PER_WORD + 1) * BITS_PER_WORD;
+    }
+
+    return pos < g_cluster_end ? pos : g_cluster_end;
+}
+
+/**
+ * 把 [start, start + count) 的簇标记为已用
+ */
+static void take_range(uint32_t start, uint32_t count)
+{
+    for (uint32_t i = start; i < start + count; i++) {
+        g_free_map[i / BITS_PER_WORD] &= ~((uint64_t) 1 << (i % BITS_PER_WORD));
+    }
+
+    __atomic_store_n(&g_free_count, g_free_count - count, __ATOMIC_RELAXED);
+    g_cursor = (start + count) / BITS_PER_WORD;
+}
+
+int alloc_init(const struct FAT *fat, uint32_t cluster_end)
+{
+    g_cluster_end = cluster_end;
+    g_map_words = (cluster_end + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    g_free_map = calloc(g_map_words, sizeof(uint64_t));
+    if (g_free_map == NULL)
+        return -1;
+
+    for (uint32_t i = CLUSTER_MIN; i < cluster_end; i++) {
+        if (fat[i].cluster == CLUSTER_FREE)
+            g_free_map[i / BITS_PER_WORD] |= (uint64_t) 1 << (i % BITS_PER_WORD);
+    }
+
+    g_free_count = 0;
+    for (uint32_t w = 0; w < g_map_words; w++) {
+        g_free_count += __builtin_popcountll(g_free_map[w]);
+    }
+
+    g_cursor = 0;
+
+    return 0;
+}
+
+void alloc_destroy(void)
+{
+    free(g_free_map);
+    g_free_map = NULL;
+    g_free_count = 0;
+}
+
+/**
+ * 查找用于分配的空闲区间
+ * @param hint 希望的起始簇号
+ * @param count 需要的簇数量
+ * @param start 保存区间的起始簇号
+ * @return 返回区间长度，可能小于 count（此时是最长的空闲区间），为 0 表示没有空闲簇
+ */
+static uint32_t find_extent(uint32_t hint, uint32_t count, uint32_t *start)
+{
+    uint32_t best_len = 0;
+
+    // 紧接着文件末尾的空闲区间
+    if (CLUSTER_MIN <= hint && hint < g_cluster_end && is_free(hint)) {
+        *start = hint;
+        best_len = find_next(hint, 0) - hint;
+        if (best_len >= count)
+            return best_len;
+    }
+
+    // 从游标开始找第一个足够长的空闲区间，同时记下最长的区间
+    uint32_t cursor = g_cursor * BITS_PER_WORD;
+    if (cursor < CLUSTER_MIN || cursor >= g_cluster_end)
+        cursor = CLUSTER_MIN;
+
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t pos = pass == 0 ? cursor : CLUSTER_MIN;
+        uint32_t stop = pass == 0 ? g_cluster_end : cursor;
+
+        while (pos < stop) {
+            uint32_t run_start = find_next(pos, 1);
+            if (run_start >= stop)
+                break;
+
+            uint32_t run_end = find_next(run_start, 0);
+            if (run_end - run_start > best_len) {
+                *start = run_start;
+                best_len = run_end - run_start;
+                if (best_len >= count)
+                    return best_len;
+            }
+
+            pos = run_end;
+        }
+    }
+
+    return best_len;
+}
+
+void alloc_lock(void)
+{
+    pthread_mutex_lock(&g_alloc_lock);
+}
+
+void alloc_unlock(void)
+{
+    pthread_mutex_unlock(&g_alloc_lock);
+}
+
+uint16_t alloc_extent(uint32_t hint, uint32_t count, uint32_t *got)
+{
+    if (g_free_count == 0 || count == 0)
+        return CLUSTER_END;
+
+    uint32_t start = CLUSTER_END;
+    uint32_t len = find_extent(hint, count, &start);
+    if (len == 0)
+        return CLUSTER_END;
+
+    if (len > count)
+        len = count;
+
+    take_range(start, len);
+    *got = len;
+
+    return (uint16_t) start;
+}
+
+void alloc_free(uint16_t cluster_num)
+{
+    assert(CLUSTER_MIN <= cluster_num && cluster_num < g_cluster_end);
+
+    uint64_t mask = (uint64_t) 1 << (cluster_num % BITS_PER_WORD);
+    assert((g_free_map[cluster_num / BITS_PER_WORD] & mask) == 0);
+
+    g_free_map[cluster_num / BITS_PER_WORD] |= mask;
+    __atomic_store_n(&g_free_count, g_free_count + 1, __ATOMIC_RELAXED);
+}
+
+uint32_t alloc_free_count(void)
+{
+    return __atomic_load_n(&g_free_count, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,60 @@
+//
+// 空闲簇分配器
+//
+
+#ifndef MYFAT_MY_ALLOC_H
+#define MYFAT_MY_ALLOC_H
+
+#include <stdint.h>
+
+struct FAT;
+
+/**
+ * 根据 FAT 表建立空闲簇位图，挂载时调用一次
+ * @param fat FAT 表
+ * @param cluster_end 最大可用簇号 + 1，簇号 [CLUSTER_MIN, cluster_end) 可被分配
+ * @return 成功返回 0，反之返回 -1
+ */
+int alloc_init(const struct FAT *fat, uint32_t cluster_end);
+
+/**
+ * 释放分配器占用的内存
+ */
+void alloc_destroy(void);
+
+/**
+ * 锁住分配器，alloc_extent 和 alloc_free 需要在持有锁时调用
+ * 一次分配多个区间时全程持有锁，保证要么全部分配到，要么一个都不分配
+ */
+void alloc_lock(void);
+
+/**
+ * 解锁分配器
+ */
+void alloc_unlock(void);
+
+/**
+ * 分配一段连续的空闲簇
+ * 优先使用从 hint 开始的连续空闲簇，其次是第一个足够长的空闲区间，
+ * 都没有的话就返回最长的空闲区间，调用者继续分配剩下的部分，使碎片数量最少
+ * 只修改位图，FAT 表由调用者负责填写
+ * @param hint 希望的起始簇号（通常是文件最后一个簇的下一个簇），CLUSTER_END 表示不指定
+ * @param count 需要的簇数量
+ * @param got 保存实际分配到的簇数量，1 <= *got <= count
+ * @return 返回起始簇号，若没有空闲簇则返回 CLUSTER_END
+ */
+uint16_t alloc_extent(uint32_t hint, uint32_t count, uint32_t *got);
+
+/**
+ * 把簇归还给分配器，O(1)
+ * @param cluster_num 簇号
+ */
+void alloc_free(uint16_t cluster_num);
+
+/**
+ * 获取空闲簇的数量，不需要持有锁
+ * @return 空闲簇的数量
+ */
+uint32_t alloc_free_count(void);
+
+#endif //MYFAT_MY_ALLOC_H
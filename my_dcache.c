@@ -0,0 +1,198 @@
+//
+// 路径到目录项的缓存
+//
+
+#include "my_dcache.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+// 哈希表的桶数
+#define DCACHE_BUCKETS 4096
+
+struct Dentry {
+    struct Dentry *hash_next;           // 哈希链表
+    struct Dentry *lru_prev;            // LRU 链表，表头是最近使用的
+    struct Dentry *lru_next;
+    struct FCB *fcb;                    // 为 NULL 表示文件不存在
+    uint32_t hash;
+    size_t len;                         // 路径长度
+    char path[];
+};
+
+static struct Dentry *g_buckets[DCACHE_BUCKETS];
+static struct Dentry *g_lru_head;
+static struct Dentry *g_lru_tail;
+static size_t g_used;                   // 已占用的内存
+static pthread_mutex_t g_dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t hash_path(const char *path, size_t len)
+{
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) path[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static size_t dentry_size(size_t len)
+{
+    return sizeof(struct Dentry) + len + 1;
+}
+
+static void lru_remove(struct Dentry *d)
+{
+    if (d->lru_prev != NULL)
+        d->lru_prev->lru_next = d->lru_next;
+    else
+        g_lru_head = d->lru_next;
+
+    if (d->lru_next != NULL)
+        d->lru_next->lru_prev = d->lru_prev;
+    else
+        g_lru_tail = d->lru_prev;
+}
+
+static void lru_push_front(struct Dentry *d)
+{
+    d->lru_prev = NULL;
+    d->lru_next = g_lru_head;
+    if (g_lru_head != NULL)
+        g_lru_head->lru_prev = d;
+    else
+        g_lru_tail = d;
+    g_lru_head = d;
+}
+
+static struct Dentry **find_slot(const char *path, size_t len, uint32_t hash)
+{
+    struct Dentry **p = &g_buckets[hash % DCACHE_BUCKETS];
+
+    while (*p != NULL) {
+        struct Dentry *d = *p;
+        if (d->hash == hash && d->len == len && memcmp(d->path, path, len) == 0)
+            break;
+        p = &d->hash_next;
+    }
+
+    return p;
+}
+
+/**
+ * 从哈希表和 LRU 链表中删除并释放
+ */
+static void dentry_remove(struct Dentry **slot)
+{
+    struct Dentry *d = *slot;
+
+    *slot = d->hash_next;
+    lru_remove(d);
+    g_used -= dentry_size(d->len);
+    free(d);
+}
+
+int dcache_lookup(const char *path, struct FCB **fcb)
+{
+    size_t len = strlen(path);
+    uint32_t hash = hash_path(path, len);
+
+    pthread_mutex_lock(&g_dcache_lock);
+
+    struct Dentry *d = *find_slot(path, len, hash);
+    if (d != NULL) {
+        if (d != g_lru_head) {
+            lru_remove(d);
+            lru_push_front(d);
+        }
+        *fcb = d->fcb;
+    }
+
+    pthread_mutex_unlock(&g_dcache_lock);
+
+    return d != NULL;
+}
+
+void dcache_insert(const char *path, struct FCB *fcb)
+{
+    size_t len = strlen(path);
+    uint32_t hash = hash_path(path, len);
+    size_t size = dentry_size(len);
+
+    pthread_mutex_lock(&g_dcache_lock);
+
+    struct Dentry **slot = find_slot(path, len, hash);
+    if (*slot != NULL) {
+        struct Dentry *d = *slot;
+        d->fcb = fcb;
+        if (d != g_lru_head) {
+            lru_remove(d);
+            lru_push_front(d);
+        }
+        pthread_mutex_unlock(&g_dcache_lock);
+        return;
+    }
+
+    if (size > DCACHE_BUDGET) {
+        pthread_mutex_unlock(&g_dcache_lock);
+        return;
+    }
+
+    // 超出上限，淘汰最久未使用的
+    while (g_used + size > DCACHE_BUDGET) {
+        struct Dentry *victim = g_lru_tail;
+        dentry_remove(find_slot(victim->path, victim->len, victim->hash));
+    }
+
+    struct Dentry *d = malloc(size);
+    if (d == NULL) {
+        pthread_mutex_unlock(&g_dcache_lock);
+        return;
+    }
+
+    d->fcb = fcb;
+    d->hash = hash;
+    d->len = len;
+    memcpy(d->path, path, len + 1);
+
+    // 淘汰时可能改变了桶里的链表，重新找插入位置
+    slot = &g_buckets[hash % DCACHE_BUCKETS];
+    d->hash_next = *slot;
+    *slot = d;
+    lru_push_front(d);
+    g_used += size;
+
+    pthread_mutex_unlock(&g_dcache_lock);
+}
+
+void dcache_invalidate_tree(const char *path)
+{
+    size_t len = strlen(path);
+
+    pthread_mutex_lock(&g_dcache_lock);
+
+    for (size_t i = 0; i < DCACHE_BUCKETS; i++) {
+        struct Dentry **p = &g_buckets[i];
+        while (*p != NULL) {
+            struct Dentry *d = *p;
+            if (d->len > len && d->path[len] == '/' && memcmp(d->path, path, len) == 0)
+                dentry_remove(p);
+            else
+                p = &d->hash_next;
+        }
+    }
+
+    pthread_mutex_unlock(&g_dcache_lock);
+}
+
+void dcache_destroy(void)
+{
+    for (size_t i = 0; i < DCACHE_BUCKETS; i++) {
+        while (g_buckets[i] != NULL) {
+            dentry_remove(&g_buckets[i]);
+        }
+    }
+}
@@ -0,0 +1,41 @@
+//
+// 路径到目录项的缓存
+//
+
+#ifndef MYFAT_MY_DCACHE_H
+#define MYFAT_MY_DCACHE_H
+
+#include <stddef.h>
+
+struct FCB;
+
+// 缓存占用内存的上限（字节）
+#define DCACHE_BUDGET (1024 * 1024)
+
+/**
+ * 查询路径对应的目录项
+ * @param path 完整路径
+ * @param fcb 命中时保存目录项指针，为 NULL 表示文件不存在（负缓存）
+ * @return 命中返回 1，反之返回 0
+ */
+int dcache_lookup(const char *path, struct FCB **fcb);
+
+/**
+ * 插入或更新路径对应的目录项，超出内存上限时淘汰最久未使用的项
+ * @param path 完整路径
+ * @param fcb 目录项指针，为 NULL 表示文件不存在
+ */
+void dcache_insert(const char *path, struct FCB *fcb);
+
+/**
+ * 删除路径下所有子路径的缓存（不包括路径本身），用于目录被移动或覆盖
+ * @param path 目录的完整路径
+ */
+void dcache_invalidate_tree(const char *path);
+
+/**
+ * 清空缓存
+ */
+void dcache_destroy(void);
+
+#endif //MYFAT_MY_DCACHE_H
@@ -0,0 +1,379 @@
+//
+// 目录的内存索引：文件名 -> 目录项，以及空闲目录项列表
+//
+
+#include "my_dirindex.h"
+#include "my_fat.h"
+
+// 目录索引哈希表的桶数
+#define DIR_BUCKETS 64
+
+// 文件名哈希表的初始容量
+#define INIT_CAPACITY 16
+
+// 每个簇的目录项数量
+#define CLUSTER_ENTRIES (CLUSTER_SIZE / sizeof(struct FCB))
+
+static struct DirIndex *g_indexes[DIR_BUCKETS];
+static pthread_mutex_t g_index_lock = PTHREAD_MUTEX_INITIALIZER;   // 保护 g_indexes
+
+// 被删除的槽，查找时要跳过，插入时可以复用
+static char g_tombstone;
+#define TOMBSTONE ((struct FCB *) &g_tombstone)
+
+static uint64_t fcb_key(const struct FCB *fcb)
+{
+    uint64_t key;
+    memcpy(&key, fcb->filename, sizeof(key));
+    return key;
+}
+
+static uint32_t hash_key(uint64_t key)
+{
+    return (uint32_t) ((key * 0x9E3779B97F4A7C15ull) >> 32);
+}
+
+/**
+ * 在哈希表中查找文件名对应的槽
+ * @return 找到返回槽，反之返回 NULL
+ */
+static struct NameSlot *table_find(struct DirIndex *index, uint64_t key)
+{
+    uint32_t mask = index->capacity - 1;
+
+    for (uint32_t i = hash_key(key) & mask; index->slots[i].fcb != NULL; i = (i + 1) & mask) {
+        if (index->slots[i].fcb != TOMBSTONE && index->slots[i].key == key)
+            return &index->slots[i];
+    }
+
+    return NULL;
+}
+
+/**
+ * 插入哈希表，不检查容量
+ */
+static void table_put(struct NameSlot *slots, uint32_t capacity, uint64_t key, struct FCB *fcb)
+{
+    uint32_t mask = capacity - 1;
+    uint32_t i = hash_key(key) & mask;
+
+    while (slots[i].fcb != NULL && slots[i].fcb != TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+
+    slots[i].key = key;
+    slots[i].fcb = fcb;
+}
+
+/**
+ * 重建哈希表，同时清理墓碑，存在的项超过一半时容量翻倍
+ * @return 成功返回 0，内存不足返回 -1
+ */
+static int table_rehash(struct DirIndex *index)
+{
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < index->capacity; i++) {
+        if (index->slots[i].fcb != NULL && index->slots[i].fcb != TOMBSTONE)
+            count++;
+    }
+
+    uint32_t capacity = index->capacity;
+    while (count * 2 >= capacity) {
+        capacity *= 2;
+    }
+
+    struct NameSlot *slots = calloc(capacity, sizeof(struct NameSlot));
+    if (slots == NULL)
+        return -1;
+
+    for (uint32_t i = 0; i < index->capacity; i++) {
+        struct NameSlot *slot = &index->slots[i];
+        if (slot->fcb != NULL && slot->fcb != TOMBSTONE)
+            table_put(slots, capacity, slot->key, slot->fcb);
+    }
+
+    free(index->slots);
+    index->slots = slots;
+    index->capacity = capacity;
+    index->used = count;
+
+    return 0;
+}
+
+/**
+ * 目录项加入哈希表，同名的只保留第一个（和线性查找的结果一致）
+ * @return 成功返回 0，内存不足返回 -1
+ */
+static int table_insert(struct DirIndex *index, struct FCB *fcb)
+{
+    uint64_t key = fcb_key(fcb);
+
+    if (table_find(index, key) != NULL)
+        return 0;
+
+    // 装载因子（含墓碑）不超过 3/4
+    if ((index->used + 1) * 4 > index->capacity * 3 && table_rehash(index) != 0)
+        return -1;
+
+    uint32_t mask = index->capacity - 1;
+    uint32_t i = hash_key(key) & mask;
+    while (index->slots[i].fcb != NULL && index->slots[i].fcb != TOMBSTONE) {
+        i = (i + 1) & mask;
+    }
+
+    if (index->slots[i].fcb == NULL)
+        index->used++;
+
+    index->slots[i].key = key;
+    index->slots[i].fcb = fcb;
+
+    if (fcb->filename[0] != '.')
+        index->live++;
+
+    return 0;
+}
+
+static void push_free(struct DirIndex *index, struct FCB *fcb)
+{
+    if (index->free_count == index->free_capacity) {
+        uint32_t capacity = index->free_capacity ? index->free_capacity * 2 : 16;
+        struct FCB **free_list = realloc(index->free, capacity * sizeof(struct FCB *));
+        if (free_list == NULL)  // 这个目录项暂时不能被重复使用，不影响正确性
+            return;
+
+        index->free = free_list;
+        index->free_capacity = capacity;
+    }
+
+    index->free[index->free_count++] = fcb;
+}
+
+/**
+ * 扫描一段连续的目录项
+ * @param cluster_num 目录项所在的簇号，根目录为 0
+ * @return 遇到终止项返回 1，反之返回 0，出错返回 -1
+ */
+static int scan_entries(struct DirIndex *index, struct FCB *dir, uint32_t entries, uint16_t cluster_num)
+{
+    for (uint32_t i = 0; i < entries; i++) {
+        if (is_entry_end(&dir[i])) {
+            index->end_cluster = cluster_num;
+            index->end_index = i;
+            index->full = 0;
+            return 1;
+        }
+
+        if (!is_entry_exists(&dir[i])) {
+            push_free(index, &dir[i]);
+        } else if (table_insert(index, &dir[i]) != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void index_free(struct DirIndex *index)
+{
+    pthread_mutex_destroy(&index->lock);
+    free(index->slots);
+    free(index->free);
+    free(index);
+}
+
+/**
+ * 扫描目录，建立索引
+ * @param error_code 保存错误码：内存不足为 -ENOMEM，目录的簇读取失败为 -EIO
+ * @return 返回目录索引，失败时返回 NULL
+ */
+static struct DirIndex *index_build(const struct FCB *dir_file, int *error_code)
+{
+    struct DirIndex *index = calloc(1, sizeof(struct DirIndex));
+    *error_code = -ENOMEM;
+    if (index == NULL)
+        return NULL;
+
+    pthread_mutex_init(&index->lock, NULL);
+    index->capacity = INIT_CAPACITY;
+    index->slots = calloc(index->capacity, sizeof(struct NameSlot));
+    index->full = 1;
+
+    int ret = index->slots == NULL ? -1 : 0;
+
+    if (dir_file == NULL) {
+        index->first_cluster = 0;
+        if (ret == 0)
+            ret = scan_entries(index, get_root_dir(), ROOT_ENTRIES, 0);
+    } else {
+        index->first_cluster = dir_file->first_cluster;
+
+        uint16_t cur = dir_file->first_cluster;
+        while (ret == 0 && is_cluster_inuse(cur)) {
+            struct FCB *dir = (struct FCB *) get_cluster(cur);
+            if (dir == NULL) {
+                *error_code = -EIO;
+                ret = -1;
+                break;
+            }
+
+            ret = scan_entries(index, dir, CLUSTER_ENTRIES, cur);
+            cur = get_fat(cur);
+        }
+    }
+
+    if (ret < 0) {
+        index_free(index);
+        return NULL;
+    }
+
+    *error_code = 0;
+    return index;
+}
+
+struct DirIndex *dir_index_get(const struct FCB *dir_file, int *error_code)
+{
+    uint16_t first_cluster = dir_file == NULL ? 0 : dir_file->first_cluster;
+    struct DirIndex **head = &g_indexes[first_cluster % DIR_BUCKETS];
+    struct DirIndex *index;
+
+    pthread_mutex_lock(&g_index_lock);
+
+    for (index = *head; index != NULL; index = index->next) {
+        if (index->first_cluster == first_cluster)
+            break;
+    }
+
+    // 还没有索引说明没有线程在修改这个目录，可以直接扫描
+    *error_code = 0;
+    if (index == NULL && (index = index_build(dir_file, error_code)) != NULL) {
+        index->next = *head;
+        *head = index;
+    }
+
+    pthread_mutex_unlock(&g_index_lock);
+
+    return index;
+}
+
+void dir_index_lock(struct DirIndex *index)
+{
+    pthread_mutex_lock(&index->lock);
+}
+
+void dir_index_unlock(struct DirIndex *index)
+{
+    pthread_mutex_unlock(&index->lock);
+}
+
+struct FCB *dir_index_lookup(struct DirIndex *index, const char *key)
+{
+    uint64_t key64;
+    memcpy(&key64, key, sizeof(key64));
+
+    struct NameSlot *slot = table_find(index, key64);
+    return slot == NULL ? NULL : slot->fcb;
+}
+
+struct FCB *dir_index_alloc(struct DirIndex *index)
+{
+    // 先给之后的 dir_index_insert 预留哈希表的空间
+    if ((index->used + 1) * 4 > index->capacity * 3 && table_rehash(index) != 0)
+        return NULL;
+
+    if (index->free_count > 0)
+        return index->free[--index->free_count];
+
+    if (index->full)
+        return NULL;
+
+    struct FCB *fcb;
+    if (index->end_cluster == 0) {  // 根目录
+        fcb = &get_root_dir()[index->end_index];
+        if (++index->end_index == ROOT_ENTRIES)
+            index->full = 1;
+    } else {
+        // 目录的簇建立索引或扩容时已经常驻内存，这里不会去读镜像文件
+        struct FCB *dir = (struct FCB *) get_cluster(index->end_cluster);
+        if (dir == NULL)
+            return NULL;
+
+        fcb = &dir[index->end_index];
+
+        // 终止项之后的簇都是空的
+        if (++index->end_index == CLUSTER_ENTRIES) {
+            uint16_t next = get_fat(index->end_cluster);
+            if (is_cluster_inuse(next)) {
+                index->end_cluster = next;
+                index->end_index = 0;
+            } else {
+                index->full = 1;
+            }
+        }
+    }
+
+    return fcb;
+}
+
+void dir_index_insert(struct DirIndex *index, struct FCB *fcb)
+{
+    // dir_index_alloc 已经预留了空间，不会再扩容
+    int ret = table_insert(index, fcb);
+    assert(ret == 0);
+    (void) ret;
+}
+
+void dir_index_remove(struct DirIndex *index, struct FCB *fcb)
+{
+    struct NameSlot *slot = table_find(index, fcb_key(fcb));
+
+    if (slot != NULL && slot->fcb == fcb) {
+        slot->fcb = TOMBSTONE;
+        if (fcb->filename[0] != '.')
+            index->live--;
+    }
+
+    push_free(index, fcb);
+}
+
+void dir_index_add_cluster(struct DirIndex *index, uint16_t cluster_num)
+{
+    if (!index->full)
+        return;
+
+    index->end_cluster = cluster_num;
+    index->end_index = 0;
+    index->full = 0;
+}
+
+void dir_index_drop(uint16_t first_cluster)
+{
+    struct DirIndex *index = NULL;
+    struct DirIndex **p = &g_indexes[first_cluster % DIR_BUCKETS];
+
+    pthread_mutex_lock(&g_index_lock);
+
+    while (*p != NULL) {
+        if ((*p)->first_cluster == first_cluster) {
+            index = *p;
+            *p = index->next;
+            break;
+        }
+        p = &(*p)->next;
+    }
+
+    pthread_mutex_unlock(&g_index_lock);
+
+    if (index != NULL)
+        index_free(index);
+}
+
+void dir_index_destroy(void)
+{
+    for (uint32_t i = 0; i < DIR_BUCKETS; i++) {
+        while (g_indexes[i] != NULL) {
+            struct DirIndex *index = g_indexes[i];
+            g_indexes[i] = index->next;
+            index_free(index);
+        }
+    }
+}
@@ -0,0 +1,103 @@
+//
+// 目录的内存索引：文件名 -> 目录项，以及空闲目录项列表
+//
+
+#ifndef MYFAT_MY_DIRINDEX_H
+#define MYFAT_MY_DIRINDEX_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+struct FCB;
+
+struct NameSlot {
+    uint64_t key;                       // 目录项中用空格补齐的 8 字节文件名
+    struct FCB *fcb;                    // NULL 表示空槽
+};
+
+// 除 dir_index_get 外，操作目录索引和目录中的目录项都要持有 lock
+struct DirIndex {
+    pthread_mutex_t lock;               // 目录锁，保护索引以及目录项的分配、写入和删除
+    uint16_t first_cluster;             // 目录的第一个簇号，根目录为 0
+    struct NameSlot *slots;             // 开放寻址哈希表
+    uint32_t capacity;                  // 哈希表容量，2 的幂
+    uint32_t used;                      // 已使用（含墓碑）的槽数
+    uint32_t live;                      // 存在的文件数量，不含 . 和 ..
+    struct FCB **free;                  // 已删除的目录项，可以重新使用
+    uint32_t free_count;
+    uint32_t free_capacity;
+    uint16_t end_cluster;               // 终止项所在的簇，根目录为 0
+    uint32_t end_index;                 // 终止项在簇内的下标
+    int full;                           // 终止项之后没有空间了，需要扩容
+    struct DirIndex *next;              // 哈希链表
+};
+
+/**
+ * 获取目录的索引，第一次访问时扫描目录建立
+ * @param dir_file 目录在父目录中的目录项，为 NULL 表示根目录
+ * @param error_code 保存错误码：内存不足为 -ENOMEM，目录的簇读取失败为 -EIO
+ * @return 返回目录索引，失败时返回 NULL
+ */
+struct DirIndex *dir_index_get(const struct FCB *dir_file, int *error_code);
+
+/**
+ * 锁住目录
+ * @param index 目录索引
+ */
+void dir_index_lock(struct DirIndex *index);
+
+/**
+ * 解锁目录
+ * @param index 目录索引
+ */
+void dir_index_unlock(struct DirIndex *index);
+
+/**
+ * 查找文件，O(1)
+ * @param index 目录索引
+ * @param key make_name_key 转换后的文件名
+ * @return 返回 FCB 控制块，找不到文件则返回 NULL
+ */
+struct FCB *dir_index_lookup(struct DirIndex *index, const char *key);
+
+/**
+ * 取出一个空闲目录项，优先使用已删除的项，其次是终止项
+ * @param index 目录索引
+ * @return 返回目录项，目录已满则返回 NULL（调用者扩容后调用 dir_index_add_cluster 再重试），内存不足或读取失败也返回 NULL
+ */
+struct FCB *dir_index_alloc(struct DirIndex *index);
+
+/**
+ * 目录项已写入文件名，加入索引，空间已由 dir_index_alloc 预留
+ * @param index 目录索引
+ * @param fcb 目录项
+ */
+void dir_index_insert(struct DirIndex *index, struct FCB *fcb);
+
+/**
+ * 目录项即将被删除（文件名还未改动），从索引中移除并放入空闲列表
+ * @param index 目录索引
+ * @param fcb 目录项
+ */
+void dir_index_remove(struct DirIndex *index, struct FCB *fcb);
+
+/**
+ * 目录新增了一个簇，簇内的目录项都可以使用
+ * @param index 目录索引
+ * @param cluster_num 新的簇号
+ */
+void dir_index_add_cluster(struct DirIndex *index, uint16_t cluster_num);
+
+/**
+ * 目录被删除，丢弃它的索引
+ * 调用者要保证没有其他线程在使用这个索引（持有目录树的写锁）
+ * @param first_cluster 目录的第一个簇号
+ */
+void dir_index_drop(uint16_t first_cluster);
+
+/**
+ * 释放所有目录索引
+ */
+void dir_index_destroy(void);
+
+#endif //MYFAT_MY_DIRINDEX_H
@@ -0,0 +1,118 @@
+//
+// 文件的区间映射：文件内簇序号 -> 簇号
+//
+
+#include "my_extent.h"
+#include "my_fat.h"
+
+void extent_map_init(struct ExtentMap *map)
+{
+    memset(map, 0, sizeof(struct ExtentMap));
+}
+
+void extent_map_clear(struct ExtentMap *map)
+{
+    free(map->extents);
+    extent_map_init(map);
+}
+
+/**
+ * 在末尾追加一个簇，和最后一个区间相邻则直接延长
+ * @return 成功返回 0，内存不足返回 -1
+ */
+static int push_cluster(struct ExtentMap *map, uint16_t cluster_num)
+{
+    if (map->count > 0) {
+        struct Extent *last = &map->extents[map->count - 1];
+        if (last->cluster + last->length == cluster_num) {
+            last->length++;
+            map->clusters++;
+            return 0;
+        }
+    }
+
+    if (map->count == map->capacity) {
+        uint32_t capacity = map->capacity ? map->capacity * 2 : 4;
+        struct Extent *extents = realloc(map->extents, capacity * sizeof(struct Extent));
+        if (extents == NULL)
+            return -1;
+
+        map->extents = extents;
+        map->capacity = capacity;
+    }
+
+    struct Extent *ext = &map->extents[map->count++];
+    ext->index = map->clusters;
+    ext->cluster = cluster_num;
+    ext->length = 1;
+    map->clusters++;
+
+    return 0;
+}
+
+int extent_map_build(struct ExtentMap *map, uint16_t first_cluster)
+{
+    extent_map_clear(map);
+
+    for (uint16_t cur = first_cluster; is_cluster_inuse(cur); cur = get_fat(cur)) {
+        if (push_cluster(map, cur) != 0) {
+            extent_map_clear(map);
+            return -1;
+        }
+    }
+
+    // 持有文件读锁的线程不加锁检查 valid，要保证它们看到的是建好的映射
+    __atomic_store_n(&map->valid, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int extent_map_lookup(const struct ExtentMap *map, uint32_t index, uint16_t *cluster_num)
+{
+    assert(map->valid);
+
+    if (index >= map->clusters)
+        return 0;
+
+    // 找到最后一个起始序号不大于 index 的区间
+    uint32_t lo = 0, hi = map->count;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (map->extents[mid].index <= index)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    const struct Extent *ext = &map->extents[lo];
+    assert(ext->index <= index && index < ext->index + ext->length);
+
+    *cluster_num = (uint16_t) (ext->cluster + (index - ext->index));
+    return 1;
+}
+
+void extent_map_append(struct ExtentMap *map, uint16_t cluster_num)
+{
+    if (!map->valid)
+        return;
+
+    if (push_cluster(map, cluster_num) != 0)  // 内存不足就放弃映射，下次访问时重建
+        extent_map_clear(map);
+}
+
+void extent_map_truncate(struct ExtentMap *map, uint32_t count)
+{
+    if (!map->valid || count >= map->clusters)
+        return;
+
+    while (map->count > 0 && map->extents[map->count - 1].index >= count) {
+        map->count--;
+    }
+
+    if (map->count > 0) {
+        struct Extent *last = &map->extents[map->count - 1];
+        if (last->index + last->length > count)
+            last->length = count - last->index;
+    }
+
+    map->clusters = count;
+}
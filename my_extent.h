@@ -0,0 +1,68 @@
+//
+// 文件的区间映射：文件内簇序号 -> 簇号
+//
+
+#ifndef MYFAT_MY_EXTENT_H
+#define MYFAT_MY_EXTENT_H
+
+#include <stdint.h>
+
+// 一段物理上连续的簇
+struct Extent {
+    uint32_t index;                     // 文件内的起始簇序号
+    uint16_t cluster;                   // 起始簇号
+    uint32_t length;                    // 连续簇的数量
+};
+
+struct ExtentMap {
+    struct Extent *extents;             // 按 index 从小到大排列
+    uint32_t count;                     // 区间数量
+    uint32_t capacity;                  // extents 数组容量
+    uint32_t clusters;                  // 文件占用的簇数量
+    int valid;                          // 是否已经从 FAT 表建立
+};
+
+/**
+ * 初始化为未建立的状态
+ * @param map 区间映射
+ */
+void extent_map_init(struct ExtentMap *map);
+
+/**
+ * 释放区间映射占用的内存，恢复为未建立的状态
+ * @param map 区间映射
+ */
+void extent_map_clear(struct ExtentMap *map);
+
+/**
+ * 沿着 FAT 簇链建立区间映射
+ * @param map 区间映射
+ * @param first_cluster 文件的第一个簇号
+ * @return 成功返回 0，内存不足返回 -1（映射保持未建立）
+ */
+int extent_map_build(struct ExtentMap *map, uint16_t first_cluster);
+
+/**
+ * 二分查找文件内第 index 个簇的簇号，O(log n)
+ * @param map 区间映射，必须已经建立
+ * @param index 文件内的簇序号
+ * @param cluster_num 保存簇号
+ * @return 找到返回 1，index 超出文件范围返回 0
+ */
+int extent_map_lookup(const struct ExtentMap *map, uint32_t index, uint16_t *cluster_num);
+
+/**
+ * 文件末尾新增了一个簇，映射未建立时什么都不做
+ * @param map 区间映射
+ * @param cluster_num 新的簇号
+ */
+void extent_map_append(struct ExtentMap *map, uint16_t cluster_num);
+
+/**
+ * 文件被截短到 count 个簇，映射未建立时什么都不做
+ * @param map 区间映射
+ * @param count 剩下的簇数量
+ */
+void extent_map_truncate(struct ExtentMap *map, uint32_t count);
+
+#endif //MYFAT_MY_EXTENT_H
@@ -2,38 +2,223 @@
 // Created by xi4oyu on 6/3/21.
 //
 
+#define _GNU_SOURCE     // pthread_rwlockattr_setkind_np, FALLOC_FL_*
+
 #include "my_fat.h"
+#include "my_image.h"
+#include "my_io.h"
+#include "my_journal.h"
+#include "my_alloc.h"
+#include "my_inode.h"
+#include "my_dcache.h"
+#include "my_dirindex.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+// 默认的读写线程数最多这么多，再多磁盘也跟不上
+#define MAX_IO_THREADS 8
 
 struct options opts;
 
-static char *g_addr;                // 预先读入到内存里
-static int g_size;                  // 内存空间大小
-static uint32_t g_data_sectors;     // 数据区扇区数
-struct FAT *g_fat[NUMBER_OF_FAT];   // fat 表
+// 目录树的结构锁：rename 和 rmdir 会改变目录树的形状，持有写锁；其余按路径访问的操作持有读锁
+// 加锁顺序：g_cut_lock -> g_ns_lock -> 目录锁（同时只持有一个）-> 文件的读写锁 -> 分配器等内部的锁
+static pthread_rwlock_t g_ns_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// 检查点的切点锁：修改 FAT 或目录的操作持有读锁，检查点复制元数据时持有写锁，复制到的是同一时刻的状态
+// 写者优先，检查点不会被源源不断的修改饿死；操作之间不会嵌套加读锁
+static pthread_rwlock_t g_cut_lock;
+
+// 后台检查点线程
+static pthread_t g_checkpointer;
+static int g_checkpoint_running;
+static pthread_mutex_t g_checkpoint_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_checkpoint_stop = PTHREAD_COND_INITIALIZER;
+
+// 检查点的累计统计
+static uint64_t g_checkpoint_count;
+static uint64_t g_checkpoint_bytes;
+static double g_checkpoint_max_ms;
+
+// 组提交：检查点进行期间到来的 flush 和 fsync 等着下一次检查点一起写出，而不是各做一次
+static pthread_mutex_t g_commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_commit_done = PTHREAD_COND_INITIALIZER;
+static int g_committing;            // 有线程正在做检查点
+static int g_commit_sync_wanted;    // 等待的线程中有需要落盘的
+static uint64_t g_commit_started;   // 开始过的检查点数
+static uint64_t g_commit_finished;  // 最后完成的检查点的序号
+static uint64_t g_commit_synced;    // 最后完成的落盘的检查点的序号
+static int g_commit_ret;            // 最后完成的检查点的结果
+
+static char *g_journal_path;        // 日志文件路径，没有启用日志时为 NULL
+
+// 快照线程：收到 SIGUSR1 时把整个卷这一刻的内容写到 opts.snapshot
+static pthread_t g_snapshotter;
+static int g_snapshot_running;
+static sem_t g_snapshot_request;    // 信号处理函数里只能 sem_post
+
+static char *g_addr;                // 预先读入到内存里，或者是 mmap 映射的镜像文件
+static size_t g_size;               // 内存空间大小
+struct Geometry g_geo;              // 卷的几何参数
+struct FAT *g_fat[MAX_FATS];        // fat 表
 struct FCB *g_root_dir;             // 根目录
 
-int fat16_format(char *addr, int size)
+/**
+ * 由基本参数计算出其余的几何参数
+ * @return 成功返回 0，参数不合法返回 -1
+ */
+static int geometry_derive(struct Geometry *geo)
+{
+    geo->cluster_size = geo->bytes_per_sector * geo->sectors_per_cluster;
+    geo->root_sectors = (geo->root_entries * sizeof(struct FCB) + geo->bytes_per_sector - 1) / geo->bytes_per_sector;
+    geo->header_sectors = geo->reserved_sectors + geo->number_of_fat * geo->sectors_per_fat + geo->root_sectors;
+
+    if (geo->total_sectors <= geo->header_sectors)
+        return -1;
+
+    // 可用的簇号同时受数据区大小和 FAT 表大小限制
+    uint32_t cluster_end = CLUSTER_MIN + (geo->total_sectors - geo->header_sectors) / geo->sectors_per_cluster;
+    uint32_t fat_entries = geo->sectors_per_fat * geo->bytes_per_sector / sizeof(struct FAT);
+    if (cluster_end > fat_entries)
+        cluster_end = fat_entries;
+    if (cluster_end > CLUSTER_MIN + MAX_CLUSTERS)
+        cluster_end = CLUSTER_MIN + MAX_CLUSTERS;
+
+    if (cluster_end <= CLUSTER_MIN)
+        return -1;
+
+    geo->cluster_end = cluster_end;
+    return 0;
+}
+
+int geometry_for_format(uint64_t size, uint32_t cluster_size, uint32_t root_entries, struct Geometry *geo)
+{
+    uint32_t bps = DEFAULT_BYTES_PER_SECTOR;
+
+    // 簇大小必须是扇区大小的 2 的幂倍，每簇扇区数只有一个字节
+    if (cluster_size < bps || cluster_size / bps > 128 || (cluster_size & (cluster_size - 1)) != 0)
+        return -1;
+
+    // 根目录项数不超过 16 位，且占满整数个扇区
+    if (root_entries == 0 || root_entries > 0xFFF0 || root_entries % (bps / sizeof(struct FCB)) != 0)
+        return -1;
+
+    memset(geo, 0, sizeof(struct Geometry));
+    geo->bytes_per_sector = bps;
+    geo->sectors_per_cluster = cluster_size / bps;
+    geo->reserved_sectors = DEFAULT_RESERVED_SECTOR;
+    geo->number_of_fat = DEFAULT_NUMBER_OF_FAT;
+    geo->root_entries = root_entries;
+
+    uint32_t root_sectors = (root_entries * sizeof(struct FCB) + bps - 1) / bps;
+    uint64_t clusters;
+
+    if (size == 0) {
+        clusters = DEFAULT_DATA_CLUSTERS;
+    } else {
+        // 先不算 FAT 表估计簇数，FAT 表的大小只会让簇数变少
+        uint64_t secs = size / bps;
+        if (secs <= geo->reserved_sectors + root_sectors)
+            return -1;
+        clusters = (secs - geo->reserved_sectors - root_sectors) / geo->sectors_per_cluster;
+
+        uint64_t spf = ((clusters + CLUSTER_MIN) * sizeof(struct FAT) + bps - 1) / bps;
+        uint64_t used = geo->reserved_sectors + root_sectors + geo->number_of_fat * spf;
+        if (secs <= used)
+            return -1;
+        clusters = (secs - used) / geo->sectors_per_cluster;
+    }
+
+    if (clusters == 0 || clusters > MAX_CLUSTERS)
+        return -1;
+
+    geo->sectors_per_fat = ((clusters + CLUSTER_MIN) * sizeof(struct FAT) + bps - 1) / bps;
+    geo->total_sectors = geo->reserved_sectors + geo->number_of_fat * geo->sectors_per_fat + root_sectors +
+                         clusters * geo->sectors_per_cluster;
+
+    return geometry_derive(geo);
+}
+
+static int is_power_of_two(uint32_t x)
+{
+    return x != 0 && (x & (x - 1)) == 0;
+}
+
+int geometry_from_boot_record(const struct BootRecord *boot_record, uint64_t size, struct Geometry *geo)
 {
-    if (size < 0 || size < HEADER_SECTORS)
+    const struct BPB *bpb = &boot_record->bpb;
+
+    // 引导扇区以跳转指令开头，以 0xaa55 结尾
+    if (boot_record->end_signature != BOOT_SIGNATURE)
+        return -1;
+    if (boot_record->jmp_boot[0] != 0xeb && boot_record->jmp_boot[0] != 0xe9)
+        return -1;
+
+    memset(geo, 0, sizeof(struct Geometry));
+    geo->bytes_per_sector = bpb->bytes_per_sector;
+    geo->sectors_per_cluster = bpb->sectors_per_cluster;
+    geo->reserved_sectors = bpb->reserved_sector;
+    geo->number_of_fat = bpb->number_of_fat;
+    geo->sectors_per_fat = bpb->sectors_per_fat;
+    geo->root_entries = bpb->root_entries;
+    geo->total_sectors = bpb->small_sector != 0 ? bpb->small_sector : bpb->large_sector;
+
+    uint32_t bps = geo->bytes_per_sector;
+    if (!is_power_of_two(bps) || bps < 512 || bps > 4096)
+        return -1;
+    if (!is_power_of_two(geo->sectors_per_cluster) || bps * geo->sectors_per_cluster > 0x10000)
+        return -1;
+    if (geo->reserved_sectors == 0 || geo->number_of_fat == 0 || geo->number_of_fat > MAX_FATS)
+        return -1;
+    if (bpb->media_descriptor != 0xf0 && bpb->media_descriptor < 0xf8)
+        return -1;
+
+    // FAT32 的根目录项数和 16 位的每 FAT 扇区数都为 0
+    if (geo->root_entries == 0 || geo->root_entries * sizeof(struct FCB) % bps != 0 || geo->sectors_per_fat == 0)
+        return -1;
+
+    if ((uint64_t) geo->total_sectors * bps > size)
+        return -1;
+
+    if (geometry_derive(geo) != 0)
+        return -1;
+
+    // 簇数超出 FAT16 的范围，或者 FAT 表不能覆盖整个数据区，说明卷不一致
+    uint64_t clusters = (geo->total_sectors - geo->header_sectors) / geo->sectors_per_cluster;
+    if (clusters > MAX_CLUSTERS)
         return -1;
+    if ((uint64_t) geo->sectors_per_fat * bps / sizeof(struct FAT) < clusters + CLUSTER_MIN)
+        return -1;
+
+    return 0;
+}
+
+int fat16_format(char *addr, const struct Geometry *geo)
+{
+    uint32_t bps = geo->bytes_per_sector;
 
-    memset(addr, 0, size);
+    // 数据区不需要清零，新分配的簇会在 file_new_cluster 里清零
+    memset(addr, 0, (size_t) geo->header_sectors * bps);
 
     struct BootRecord *boot_record = (struct BootRecord *) addr;
     struct BPB *bpb = &boot_record->bpb;
     struct EBPB *ebpb = &boot_record->ebpb;
-    uint32_t secs = size / BYTES_PER_SECTOR;
+    uint32_t secs = geo->total_sectors;
 
     memcpy(boot_record->jmp_boot, "\xeb\x3c\x90", sizeof(boot_record->jmp_boot));  // 这里不处理，直接跳到 boot_code 处
     memcpy(boot_record->oem_id, "my_fat16", 8);
     memset(boot_record->boot_code, 0, sizeof(boot_record->boot_code));  // 引导代码，随便填
-    boot_record->end_signature = 0xAA550000;
+    boot_record->end_signature = BOOT_SIGNATURE;
 
-    bpb->bytes_per_sector = BYTES_PER_SECTOR;
-    bpb->sectors_per_cluster = SECTORS_PER_CLUSTER;
-    bpb->reserved_sector = RESERVED_SECTOR;
-    bpb->number_of_fat = NUMBER_OF_FAT;
-    bpb->root_entries = ROOT_ENTRIES;
+    bpb->bytes_per_sector = bps;
+    bpb->sectors_per_cluster = geo->sectors_per_cluster;
+    bpb->reserved_sector = geo->reserved_sectors;
+    bpb->number_of_fat = geo->number_of_fat;
+    bpb->root_entries = geo->root_entries;
 
     if ((secs & 0xffff0000) == 0) {
         bpb->small_sector = (uint16_t) secs;
@@ -43,7 +228,7 @@ int fat16_format(char *addr, int size)
         bpb->large_sector = secs;
     }
 
-    bpb->sectors_per_fat = SECTORS_PER_FAT;
+    bpb->sectors_per_fat = geo->sectors_per_fat;
 
     // 按照 3.5 英寸单面，每面 80 个磁道，每磁道 9 个扇区 (360 KB) 随便填
     bpb->media_descriptor = 0xf8;  // 0xf8 表示硬盘
@@ -54,139 +239,522 @@ int fat16_format(char *addr, int size)
 
     ebpb->physical_drive_number = 0x80;  // 物理硬盘
     ebpb->reserved = 1;
-    ebpb->extended_boot_signature = 0; //0x28;  // 0x28/0x29 给 windows 识别用
+    ebpb->extended_boot_signature = 0x29;  // 0x29 表示后面的卷序号、卷标和文件系统类型有效
     ebpb->volume_serial_number = 0x1234;   // 随便填
-    strcpy(ebpb->volume_label, "my_fat16");
-    strcpy(ebpb->file_system_type, "FAT16");
-
-    struct FAT *fat[NUMBER_OF_FAT];
+    memcpy(ebpb->volume_label, "my_fat16   ", sizeof(ebpb->volume_label));  // 不足的部分用空格补齐
+    memcpy(ebpb->file_system_type, "FAT16   ", sizeof(ebpb->file_system_type));
 
     // 初始化 fat 表
-    for (int i = 0; i < NUMBER_OF_FAT; i++) {
-        fat[i] = (struct FAT *) (addr + (RESERVED_SECTOR + SECTORS_PER_FAT * i) * BYTES_PER_SECTOR);
-    }
-
-    for (int i = 0; i < NUMBER_OF_FAT; i++) {
-        fat[i][0].cluster = 0xfff8;     // 最低字节 0xf8 和 bpb->media_descriptor 保持一致
-        fat[i][1].cluster = CLUSTER_END;     // 第一个簇不使用
+    for (uint32_t i = 0; i < geo->number_of_fat; i++) {
+        struct FAT *fat = (struct FAT *) (addr + (geo->reserved_sectors + geo->sectors_per_fat * i) * bps);
+        fat[0].cluster = 0xfff8;     // 最低字节 0xf8 和 bpb->media_descriptor 保持一致
+        fat[1].cluster = CLUSTER_END;     // 第一个簇不使用
     }
 
     return 0;
 }
 
-struct FCB *find_file(struct FCB *root, uint32_t entries, const char *path, int *error_code)
+void make_name_key(const char *name, char *key)
 {
+    size_t len = strnlen(name, MAX_FILENAME);
 
-    struct FCB *file = NULL;
+    memcpy(key, name, len);
+    memset(key + len, ' ', MAX_FILENAME - len);
+}
 
-    size_t path_len = strlen(path);
-    char *tmp = strdup(path);
-    char *name = strtok(tmp, "/");
+struct FCB *find_entry(struct FCB *dir, uint32_t entries, const char *key, int *end)
+{
+    uint64_t key64;
 
-    assert(error_code != NULL);
-    *error_code = 0;
+    assert(MAX_FILENAME == sizeof(key64));
+    memcpy(&key64, key, sizeof(key64));
 
-    if (name == NULL) { // 路径是根目录的情况
-        *error_code = -ENOENT;
+    *end = 0;
+
+    // 这样的文件名只会匹配到空闲项或已删除的项
+    if (key[0] == ' ' || key[0] == '\0' || key[0] == FILE_DELETE) {
+        *end = 1;
         return NULL;
     }
 
-    fuse_log(FUSE_LOG_INFO, "find_file current filename: %s\n", name);
-
-    char *filename;
+    // 能匹配上的项首字节必定不是 0、空格或 FILE_DELETE，比较文件名时也就排除了空闲项和已删除的项，
+    // 只需要额外检查终止项；文件名 8 个字节作为一个整数比较
     for (size_t i = 0; i < entries; i++) {
-        if (is_entry_end(&root[i]))  // 最后一项，后续的不用继续扫描了
-            break;
+        if (is_entry_end(&dir[i])) {  // 最后一项，后续的不用继续扫描了
+            *end = 1;
+            return NULL;
+        }
 
-        if (is_entry_exists(&root[i])) {
-            filename = get_filename(&root[i]);
-            if (strncmp(filename, name, 8) == 0) {  // 忽略扩展名
-                file = &root[i];
-                break;
-            }
-            free(filename);
+        uint64_t name;
+        memcpy(&name, dir[i].filename, sizeof(name));
+        if (name == key64)  // 忽略扩展名
+            return &dir[i];
+    }
+
+    return NULL;
+}
+
+struct FCB *find_in_dir(const struct FCB *dir_file, const char *name, int *error_code)
+{
+    int end;
+    char key[MAX_FILENAME];
+
+    make_name_key(name, key);
+
+    struct DirIndex *index = dir_index_get(dir_file, error_code);
+    if (index != NULL)
+        return dir_index_lookup(index, key);
+
+    // 读取失败时逐项查找也读不到
+    if (*error_code != -ENOMEM)
+        return NULL;
+
+    // 内存不足，建不了索引，只能逐项查找
+    *error_code = 0;
+    if (dir_file == NULL)
+        return find_entry(g_root_dir, ROOT_ENTRIES, key, &end);
+
+    struct FCB *file = NULL;
+    uint16_t cur_cluster = dir_file->first_cluster;
+
+    while (is_cluster_inuse(cur_cluster) && file == NULL) {
+        struct FCB *dir = (struct FCB *) get_cluster(cur_cluster);
+        if (dir == NULL) {
+            *error_code = -EIO;
+            return NULL;
         }
+
+        file = find_entry(dir, CLUSTER_SIZE / sizeof(struct FCB), key, &end);
+        if (end)
+            break;
+
+        cur_cluster = g_fat[0][cur_cluster].cluster;    // 下一个簇号
     }
 
-    char *next = name + strlen(name) + 1;
+    return file;
+}
 
-//    // 跳过连续的 '/'
-//    while (next < tmp + path_len && *next == '/') {
-//        next++;
-//    }
+int lookup_parent(const char *path, struct FCB **dir_file)
+{
+    *dir_file = NULL;
 
-    if (next < tmp + path_len && *next != '\0') { // 递归调用下一层
-        if (file != NULL && file->metadata & META_DIRECTORY) {
-            struct FCB *ret = NULL;
+    const char *name = strrchr(path, '/');
+    if (name == NULL || name == path)  // 在根目录下
+        return 0;
 
-            uint32_t new_entries = BYTES_PER_SECTOR * SECTORS_PER_CLUSTER / sizeof(struct FCB);
-            uint16_t cur_cluster = file->first_cluster;
-            struct FCB *new_root;
-            int err_code = -1;
+    char *parent = strndup(path, name - path);
+    if (parent == NULL)
+        return -ENOMEM;
 
-            while (is_cluster_inuse(cur_cluster) && err_code != 0 && ret == NULL) {
-                new_root = (struct FCB *) get_cluster(cur_cluster);
+    int error_code;
+    *dir_file = lookup_path(parent, &error_code);
+    free(parent);
 
-                assert(new_root != NULL);
+    if (error_code != 0)
+        return error_code;
 
-                ret = find_file(new_root, new_entries, next, &err_code);
-                cur_cluster = g_fat[0][cur_cluster].cluster;    // 下一个簇号
-            }
-            *error_code = err_code;
-            file = ret;
-        } else if (file == NULL) { // 找不到文件
+    if (!((*dir_file)->metadata & META_DIRECTORY))
+        return -ENOTDIR;
+
+    return 0;
+}
+
+int lock_parent(const char *path, struct FCB **dir_file, struct DirIndex **index)
+{
+    *index = NULL;
+
+    int error_code = lookup_parent(path, dir_file);
+    if (error_code != 0)
+        return error_code;
+
+    *index = dir_index_get(*dir_file, &error_code);
+    if (*index == NULL)
+        return error_code;
+
+    dir_index_lock(*index);
+    return 0;
+}
+
+struct FCB *lookup_child(struct DirIndex *index, const char *path)
+{
+    struct FCB *file;
+
+    if (dcache_lookup(path, &file))
+        return file;
+
+    // 文件名超过 8 个字符的文件不可能存在
+    const char *name = strrchr(path, '/') + 1;
+    file = NULL;
+    if (strlen(name) <= MAX_FILENAME) {
+        char key[MAX_FILENAME];
+        make_name_key(name, key);
+        file = dir_index_lookup(index, key);
+    }
+
+    // 持有目录锁时写入缓存，不会覆盖掉其他线程刚插入的结果
+    dcache_insert(path, file);
+    return file;
+}
+
+struct FCB *lookup_path(const char *path, int *error_code)
+{
+    struct FCB *file;
+
+    *error_code = 0;
+
+    if (dcache_lookup(path, &file)) {
+        if (file == NULL)
             *error_code = -ENOENT;
-            file = NULL;
-        } else { // 不是目录不能继续往下查找
-            *error_code = -ENOTDIR;
-            file = NULL;
-        }
+        return file;
+    }
+
+    const char *name = strrchr(path, '/');
+    if (name == NULL || name[1] == '\0') { // 根目录
+        *error_code = -ENOENT;
+        return NULL;
     }
 
+    // 父目录也经过缓存查找
+    struct FCB *dir_file;
+    struct DirIndex *index;
+    *error_code = lock_parent(path, &dir_file, &index);
+    if (*error_code != 0)
+        return NULL;
+
+    file = lookup_child(index, path);
+    dir_index_unlock(index);
+
     if (file == NULL)
         *error_code = -ENOENT;
 
-    free(tmp);
     return file;
 }
 
+static double elapsed_ms(const struct timespec *start, const struct timespec *end)
+{
+    return (double) (end->tv_sec - start->tv_sec) * 1e3 + (double) (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/**
+ * 做一次检查点：短暂阻止元数据修改，取走修改标记并复制元数据，之后在不阻止任何操作的情况下写出
+ * @param sync 为 1 则等待落盘
+ * @return 成功返回 0，失败返回 -errno
+ */
+static int checkpoint(int sync)
+{
+    struct timespec start, cut, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_rwlock_wrlock(&g_cut_lock);
+    int ret = image_checkpoint_begin();
+    pthread_rwlock_unlock(&g_cut_lock);
+
+    if (ret != 0) {
+        fuse_log(FUSE_LOG_ERR, "checkpoint: failed to take a cut: %d\n", ret);
+        return ret;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &cut);
+
+    struct CheckpointStats stats;
+    ret = image_checkpoint_end(&stats, sync);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (stats.bytes == 0 && stats.discard_bytes == 0)
+        return ret;
+
+    double ms = elapsed_ms(&start, &end);
+    g_checkpoint_count++;
+    g_checkpoint_bytes += stats.bytes;
+    if (ms > g_checkpoint_max_ms)
+        g_checkpoint_max_ms = ms;
+
+    fuse_log(FUSE_LOG_INFO, "checkpoint: %zu bytes (%zu metadata, %zu journaled, %zu punched) in %.2f ms, "
+                            "modifications paused %.2f ms\n",
+             stats.bytes, stats.meta_bytes, stats.journal_bytes, stats.discard_bytes, ms, elapsed_ms(&start, &cut));
+
+    return ret;
+}
+
+/**
+ * 保证调用之前的修改都被写出：已经有检查点在进行时，等它结束后和其他等待的线程共用下一次检查点
+ * @param sync 为 1 则等待落盘
+ * @return 成功返回 0，失败返回 -errno
+ */
+static int commit(int sync)
+{
+    pthread_mutex_lock(&g_commit_lock);
+
+    // 正在进行的检查点可能没包含调用之前的修改，需要在这之后开始的检查点
+    uint64_t target = g_commit_started + 1;
+
+    while (g_committing) {
+        if (sync)
+            g_commit_sync_wanted = 1;
+        pthread_cond_wait(&g_commit_done, &g_commit_lock);
+
+        if ((sync ? g_commit_synced : g_commit_finished) >= target) {
+            int ret = g_commit_ret;
+            pthread_mutex_unlock(&g_commit_lock);
+            return ret;
+        }
+    }
+
+    g_committing = 1;
+    sync |= g_commit_sync_wanted;
+    g_commit_sync_wanted = 0;
+    uint64_t seq = ++g_commit_started;
+    pthread_mutex_unlock(&g_commit_lock);
+
+    int ret = checkpoint(sync);
+
+    pthread_mutex_lock(&g_commit_lock);
+    g_committing = 0;
+    g_commit_finished = seq;
+    if (sync)
+        g_commit_synced = seq;
+    g_commit_ret = ret;
+    pthread_cond_broadcast(&g_commit_done);
+    pthread_mutex_unlock(&g_commit_lock);
+
+    return ret;
+}
+
+static void *checkpoint_thread(void *arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&g_checkpoint_lock);
+
+    while (g_checkpoint_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += opts.checkpoint_ms / 1000;
+        deadline.tv_nsec += (long) (opts.checkpoint_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        int err = 0;
+        while (g_checkpoint_running && err == 0)
+            err = pthread_cond_timedwait(&g_checkpoint_stop, &g_checkpoint_lock, &deadline);
+
+        if (!g_checkpoint_running)
+            break;
+
+        pthread_mutex_unlock(&g_checkpoint_lock);
+        commit(0);
+        pthread_mutex_lock(&g_checkpoint_lock);
+    }
+
+    pthread_mutex_unlock(&g_checkpoint_lock);
+    return NULL;
+}
+
+/**
+ * 写一次快照：阻止修改的时间只有 fork 的耗时，写文件由子进程完成
+ * @return 成功返回 0，失败返回 -errno
+ */
+static int snapshot(void)
+{
+    struct timespec start, cut, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_rwlock_wrlock(&g_cut_lock);
+    pid_t pid = image_snapshot_begin(opts.snapshot);
+    pthread_rwlock_unlock(&g_cut_lock);
+
+    if (pid < 0) {
+        fuse_log(FUSE_LOG_ERR, "snapshot: failed to start: %d\n", (int) pid);
+        return (int) pid;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &cut);
+
+    int ret = image_snapshot_end(pid);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (ret != 0)
+        fuse_log(FUSE_LOG_ERR, "snapshot: failed to write %s: %d\n", opts.snapshot, ret);
+    else
+        fuse_log(FUSE_LOG_INFO, "snapshot: wrote %s in %.2f ms, modifications paused %.2f ms\n",
+                 opts.snapshot, elapsed_ms(&start, &end), elapsed_ms(&start, &cut));
+
+    return ret;
+}
+
+static void request_snapshot(int sig)
+{
+    (void) sig;
+    sem_post(&g_snapshot_request);
+}
+
+static void *snapshot_thread(void *arg)
+{
+    (void) arg;
+
+    for (;;) {
+        while (sem_wait(&g_snapshot_request) != 0 && errno == EINTR)
+            continue;
+
+        if (!__atomic_load_n(&g_snapshot_running, __ATOMIC_ACQUIRE))
+            break;
+
+        snapshot();
+    }
+
+    return NULL;
+}
+
 void *my_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
 {
     cfg->kernel_cache = 1;
 
-    g_size = DRIVE_SIZE;
-    g_addr = (char *) malloc(g_size);
+    struct Geometry geo;
+
+    // mmap 模式下内核随时会把修改写回文件，日志保证不了什么
+    if (opts.journal && opts.use_mmap) {
+        fuse_log(FUSE_LOG_ERR, "init: --journal has no effect with --mmap\n");
+    } else if (opts.journal) {
+        g_journal_path = malloc(strlen(opts.filename) + sizeof(".journal"));
+        if (g_journal_path == NULL)
+            abort();
+        sprintf(g_journal_path, "%s.journal", opts.filename);
+    }
 
     if (opts.is_create) {
-        fuse_log(FUSE_LOG_INFO, "init: create an memory for formatting file system..\n");
-        fat16_format(g_addr, DRIVE_SIZE);
+        uint64_t size = (uint64_t) opts.size_mb << 20;
+        uint32_t cluster_size = opts.cluster_size != 0 ? opts.cluster_size : DEFAULT_CLUSTER_SIZE;
+        uint32_t root_entries = opts.root_entries != 0 ? opts.root_entries : DEFAULT_ROOT_ENTRIES;
+
+        if (geometry_for_format(size, cluster_size, root_entries, &geo) != 0) {
+            fuse_log(FUSE_LOG_ERR, "init: invalid geometry (size %u MB, cluster %u, root entries %u)\n",
+                     opts.size_mb, cluster_size, root_entries);
+            abort();
+        }
     } else {
-        fuse_log(FUSE_LOG_INFO, "init: load file %s to memory\n", opts.filename);
-        FILE *fp = fopen(opts.filename, "rb");
-        if (fp != NULL) {
-
-            size_t pos = 0;
-            size_t n = 0;
-            while (pos < g_size) {
-                n = fread(g_addr + pos, 1, g_size - pos, fp);
-                pos += n;
+        // 上次没有正常卸载时，日志里提交过的元数据可能还没写回原处，引导扇区也可能在其中
+        if (g_journal_path != NULL) {
+            size_t replayed;
+            int err = journal_replay(g_journal_path, opts.filename, &replayed);
+            if (err != 0) {
+                fuse_log(FUSE_LOG_ERR, "init: failed to replay journal %s: %d\n", g_journal_path, err);
+                abort();
             }
+            if (replayed > 0)
+                fuse_log(FUSE_LOG_INFO, "init: replayed %zu transactions from %s\n", replayed, g_journal_path);
+        }
 
-            fclose(fp);
-        } else {
-            fuse_log(FUSE_LOG_ERR, "init: failed to load file %s\n", opts.filename);
+        // 已有的镜像按引导扇区里记录的参数挂载，先只读出引导扇区做校验，不合法的卷在加载前就被拒绝
+        struct BootRecord boot_record;
+        off_t file_size;
+        if (image_peek(opts.filename, &boot_record, sizeof(boot_record), &file_size) != 0 ||
+            geometry_from_boot_record(&boot_record, (uint64_t) file_size, &geo) != 0) {
+            fuse_log(FUSE_LOG_ERR, "init: %s is not a valid FAT16 image\n", opts.filename);
             abort();
         }
     }
 
-    g_data_sectors = (g_size / BYTES_PER_SECTOR) - HEADER_SECTORS;
+    g_geo = geo;
+    g_size = (size_t) geo.total_sectors * geo.bytes_per_sector;
+
+    // 按需载入时引导扇区、FAT 和根目录常驻内存，数据区的簇在第一次访问时才读入
+    if (opts.cache_mb != 0 && !opts.use_mmap)
+        image_set_cache((size_t) opts.cache_mb << 20, (size_t) geo.header_sectors * geo.bytes_per_sector,
+                        geo.cluster_size);
+
+    if (io_set_engine(opts.io_engine) != 0) {
+        fuse_log(FUSE_LOG_ERR, "init: unknown I/O engine %s\n", opts.io_engine);
+        abort();
+    }
+
+    // 整个读入内存时先读引导扇区、FAT 和根目录就开始服务，数据区由 threads 个后台线程读入
+    // 大批量的同步读写拆给 threads - 1 个工作线程，发起的线程自己也算一个
+    unsigned threads = opts.io_threads;
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus < 1 ? 1 : cpus > MAX_IO_THREADS ? MAX_IO_THREADS : (unsigned) cpus;
+    }
+
+    if (opts.cache_mb == 0 && !opts.use_mmap)
+        image_set_prefetch((size_t) geo.header_sectors * geo.bytes_per_sector, geo.cluster_size, threads);
+
+    if (io_set_workers(threads - 1) != 0)
+        fuse_log(FUSE_LOG_WARNING, "init: failed to start all I/O threads\n");
+
+    fuse_log(FUSE_LOG_INFO, "init: %s file %s (%s I/O, %u threads)\n", opts.use_mmap ? "map" : "load", opts.filename,
+             io_engine_name(), threads);
+    g_addr = image_open(opts.filename, g_size, opts.is_create, opts.use_mmap);
+    if (g_addr == NULL) {
+        fuse_log(FUSE_LOG_ERR, "init: failed to load file %s\n", opts.filename);
+        abort();
+    }
+
+    // 日志在重放之后清空，新建镜像时丢弃旧的日志
+    if (g_journal_path != NULL && journal_open(g_journal_path, g_size) != 0) {
+        fuse_log(FUSE_LOG_ERR, "init: failed to open journal %s\n", g_journal_path);
+        abort();
+    }
+
+    if (opts.is_create) {
+        fuse_log(FUSE_LOG_INFO, "init: formatting file system..\n");
+        fat16_format(g_addr, &geo);
+        image_mark_dirty(g_addr, (size_t) geo.header_sectors * geo.bytes_per_sector);
+    }
 
     // 读入 FAT
-    for (int i = 0; i < NUMBER_OF_FAT; i++) {
-        g_fat[i] = (struct FAT *) (g_addr + (RESERVED_SECTOR + SECTORS_PER_FAT * i) * BYTES_PER_SECTOR);
+    for (uint32_t i = 0; i < geo.number_of_fat; i++) {
+        g_fat[i] = (struct FAT *) (g_addr + (size_t) (geo.reserved_sectors + geo.sectors_per_fat * i) * geo.bytes_per_sector);
     }
 
-    g_root_dir = (struct FCB *) (g_addr + (RESERVED_SECTOR + SECTORS_PER_FAT * NUMBER_OF_FAT) * BYTES_PER_SECTOR);
+    g_root_dir = (struct FCB *) (g_addr + (size_t) (geo.reserved_sectors + geo.sectors_per_fat * geo.number_of_fat) *
+                                          geo.bytes_per_sector);
+
+    if (alloc_init(g_fat[0], geo.cluster_end) != 0) {
+        fuse_log(FUSE_LOG_ERR, "init: failed to build free cluster map\n");
+        abort();
+    }
+
+    // 已有的镜像里空闲的簇可能还占着文件空间（旧的内容），回写时打洞释放
+    if (!opts.is_create)
+        discard_free_clusters();
+
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&g_cut_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    // 定期把修改写回镜像文件，进程崩溃时最多丢失一个周期的修改
+    if (opts.checkpoint_ms != 0) {
+        g_checkpoint_running = 1;
+        if (pthread_create(&g_checkpointer, NULL, checkpoint_thread, NULL) != 0) {
+            fuse_log(FUSE_LOG_ERR, "init: failed to start the checkpoint thread\n");
+            g_checkpoint_running = 0;
+        }
+    }
+
+    // kill -USR1 写一次快照，mmap 模式下内存就是文件本身，没有写时复制的副本
+    if (opts.snapshot != NULL && opts.use_mmap) {
+        fuse_log(FUSE_LOG_ERR, "init: --snapshot has no effect with --mmap\n");
+    } else if (opts.snapshot != NULL) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = request_snapshot;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+
+        sem_init(&g_snapshot_request, 0, 0);
+        g_snapshot_running = 1;
+        if (pthread_create(&g_snapshotter, NULL, snapshot_thread, NULL) != 0 ||
+            sigaction(SIGUSR1, &sa, NULL) != 0) {
+            fuse_log(FUSE_LOG_ERR, "init: failed to start the snapshot thread\n");
+            abort();
+        }
+    }
 
     return NULL;
 }
@@ -207,12 +775,20 @@ int my_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
     if (strcmp(path, "/") == 0) {
         stbuf->st_mode = S_IFDIR | 0755;
         stbuf->st_nlink = 2;
-    } else {
-        int err_code;
-        struct FCB *file = find_file(g_root_dir, ROOT_ENTRIES, path, &err_code);
+        return 0;
+    }
 
-        if (err_code != 0) {
-            res = err_code;
+    pthread_rwlock_rdlock(&g_ns_lock);
+
+    // 持有父目录锁，目录项不会在读取时被删除或重用
+    struct FCB *dir_file;
+    struct DirIndex *index;
+    res = lock_parent(path, &dir_file, &index);
+    if (res == 0) {
+        struct FCB *file = lookup_child(index, path);
+
+        if (file == NULL) {
+            res = -ENOENT;
         } else if ((file->metadata & META_VOLUME_LABEL)) {
             res = -ENOENT;
         } else if (file->metadata & META_DIRECTORY) {
@@ -221,10 +797,18 @@ int my_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
         } else {
             stbuf->st_mode = 0777 | S_IFREG;
             stbuf->st_nlink = 1;
+
+            // 打开的文件在 inode 的写锁下改变大小，只持有父目录锁读不到一致的值
+            struct Inode *inode = inode_rdlock(file);
             stbuf->st_size = file->size;
+            inode_unlock(inode);
         }
+
+        dir_index_unlock(index);
     }
 
+    pthread_rwlock_unlock(&g_ns_lock);
+
     return res;
 }
 
@@ -241,17 +825,33 @@ int my_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset
     uint32_t entries = ROOT_ENTRIES;
     char *filename;
     int is_root = strcmp(path, "/") == 0;
+    struct FCB *file = NULL;
+
+    pthread_rwlock_rdlock(&g_ns_lock);
 
     if (!is_root) {
         int err;
-        struct FCB *file = find_file(g_root_dir, ROOT_ENTRIES, path, &err);
+        file = lookup_path(path, &err);
+
+        if (err == 0 && !(file->metadata & META_DIRECTORY))
+            err = -ENOTDIR;
 
-        if (err != 0)
+        if (err != 0) {
+            pthread_rwlock_unlock(&g_ns_lock);
             return err;
+        }
+    }
 
-        if (file == NULL)
-            return -ENOENT;
+    // 遍历期间不能有线程在这个目录里增删文件
+    int err_code;
+    struct DirIndex *index = dir_index_get(file, &err_code);
+    if (index == NULL) {
+        pthread_rwlock_unlock(&g_ns_lock);
+        return err_code;
+    }
+    dir_index_lock(index);
 
+    if (!is_root) {
         uint16_t cur_cluster = file->first_cluster;
         entries = CLUSTER_SIZE / sizeof(struct FCB);
 
@@ -259,8 +859,10 @@ int my_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset
 
         while (is_cluster_inuse(cur_cluster) && !stop) {
             item = (struct FCB *) get_cluster(cur_cluster);
-
-            assert(item != NULL);
+            if (item == NULL) {
+                err_code = -EIO;
+                break;
+            }
 
             for (size_t i = 0; i < entries; i++) {
                 if (is_entry_end(&item[i])) {
@@ -294,177 +896,400 @@ int my_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset
         }
     }
 
-    return 0;
+    dir_index_unlock(index);
+    pthread_rwlock_unlock(&g_ns_lock);
+
+    return err_code;
+}
+
+/**
+ * 按路径打开文件，持有父目录锁，保证拿到句柄时目录项没有被删除
+ * @param path 文件路径
+ * @param fh 保存文件句柄
+ * @return 成功返回 0，反之返回错误码
+ */
+static int open_path(const char *path, struct FileHandle **fh)
+{
+    struct FCB *dir_file;
+    struct DirIndex *index;
+
+    pthread_rwlock_rdlock(&g_ns_lock);
+
+    int err = lock_parent(path, &dir_file, &index);
+    if (err == 0) {
+        struct FCB *file = lookup_child(index, path);
+
+        if (file == NULL || (file->metadata & META_VOLUME_LABEL)) // 未找到文件
+            err = -ENOENT;
+        else if ((*fh = handle_open(file)) == NULL)
+            err = -ENOMEM;
+
+        dir_index_unlock(index);
+    }
+
+    pthread_rwlock_unlock(&g_ns_lock);
+
+    return err;
 }
 
 int my_open(const char *path, struct fuse_file_info *fi)
 {
     fuse_log(FUSE_LOG_INFO, "open: %s\n", path);
 
-    struct FCB *file = NULL;
+    if (strcmp("/", path) == 0)
+        return 0;
+
+    // 之后的读写直接通过句柄找到目录项，不用再解析路径
+    struct FileHandle *fh;
+    int ret = open_path(path, &fh);
+    if (ret != 0)
+        return ret;
+
+    if (fi->flags & O_TRUNC) {
+        pthread_rwlock_rdlock(&g_cut_lock);
+        pthread_rwlock_wrlock(&fh->inode->lock);
+        ret = _truncate(fh->inode->fcb, 0);
+        pthread_rwlock_unlock(&fh->inode->lock);
+        pthread_rwlock_unlock(&g_cut_lock);
+
+        if (ret != 0) {
+            handle_close(fh);
+            return ret;
+        }
+    }
+
+    fi->fh = (uintptr_t) fh;
+    return 0;  // 找到文件了
+}
+
+/**
+ * 目录项即将被删除，从父目录的索引中移除，调用者持有目录树的写锁
+ * @param path 目录项的路径
+ * @param file 目录项
+ */
+static void remove_from_parent(const char *path, struct FCB *file)
+{
+    struct FCB *dir_file;
+    if (lookup_parent(path, &dir_file) != 0)
+        return;
+
+    int err_code;
+    struct DirIndex *index = dir_index_get(dir_file, &err_code);
+    if (index != NULL)
+        dir_index_remove(index, file);
+}
+
+int my_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    fuse_log(FUSE_LOG_INFO, "create: %s\n", path);
+
+    (void) mode;
+
+    if (strcmp(path, "/") == 0)
+        return -EINVAL;
+
+    const char *name = strrchr(path, '/') + 1;
+    if (!is_filename_available(name))
+        return -EINVAL;
+
+    pthread_rwlock_rdlock(&g_cut_lock);
+    pthread_rwlock_rdlock(&g_ns_lock);
+
+    struct FCB *dir_file;
+    struct DirIndex *index;
+    int err_code = lock_parent(path, &dir_file, &index);
+    if (err_code != 0) {
+        pthread_rwlock_unlock(&g_ns_lock);
+        pthread_rwlock_unlock(&g_cut_lock);
+        return err_code;
+    }
+
+    struct FCB *file = lookup_child(index, path);
+    if (file != NULL) {  // 文件已存在
+        err_code = -EEXIST;
+    } else if ((file = alloc_entry(dir_file, index, &err_code)) != NULL) {  // 目录项满了或读取失败时返回 NULL
+        memset(file, 0, sizeof(struct FCB));
+        memset(file->filename, ' ', MAX_FILENAME);
+        memset(file->extname, ' ', MAX_EXTNAME);
+        memcpy(file->filename, name, strlen(name));
+        file->first_cluster = CLUSTER_END;
+        image_mark_dirty(file, sizeof(struct FCB));
+        dir_index_insert(index, file);
+        dcache_insert(path, file);
+
+        struct FileHandle *fh = handle_open(file);
+        if (fh == NULL)
+            err_code = -ENOMEM;
+        else
+            fi->fh = (uintptr_t) fh;
+    }
+
+    dir_index_unlock(index);
+    pthread_rwlock_unlock(&g_ns_lock);
+    pthread_rwlock_unlock(&g_cut_lock);
+
+    return err_code;
+}
+
+int my_unlink(const char *path)
+{
+    fuse_log(FUSE_LOG_INFO, "unlink: %s\n", path);
+
+    pthread_rwlock_rdlock(&g_cut_lock);
+    pthread_rwlock_rdlock(&g_ns_lock);
+
+    struct FCB *dir_file;
+    struct DirIndex *index;
+    int err_code = lock_parent(path, &dir_file, &index);
+    if (err_code != 0) {
+        pthread_rwlock_unlock(&g_ns_lock);
+        pthread_rwlock_unlock(&g_cut_lock);
+        return err_code;
+    }
+
+    struct FCB *file = lookup_child(index, path);
+    if (file == NULL || (file->metadata & META_VOLUME_LABEL)) {
+        err_code = -ENOENT;
+    } else if ((file->metadata & META_DIRECTORY)) {
+        err_code = -EISDIR;
+    } else {
+        dir_index_remove(index, file);
+        remove_file(file);
+        dcache_insert(path, NULL);
+    }
+
+    dir_index_unlock(index);
+    pthread_rwlock_unlock(&g_ns_lock);
+    pthread_rwlock_unlock(&g_cut_lock);
+
+    return err_code;
+}
+
+int my_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    fuse_log(FUSE_LOG_INFO, "read: %s\n", path);
+
+    struct FileHandle *fh = handle_of(fi);
 
-    if (strcmp("/", path) == 0)
-        return 0;
+    if (fh == NULL) {
+        if (strcmp(path, "/") == 0) {
+            return -EISDIR;
+        }
+
+        // 没有句柄时临时打开一次，和其他句柄一样加锁
+        int err_code = open_path(path, &fh);
+        if (err_code != 0)
+            return err_code;
+    }
 
-    int err;
-    file = find_file(g_root_dir, ROOT_ENTRIES, path, &err);
+    int ret;
 
-    if (err != 0)
-        return err;
+    // 读锁：同一个文件的读可以并发
+    pthread_rwlock_rdlock(&fh->inode->lock);
 
-    if (file == NULL || (file->metadata & META_VOLUME_LABEL)) // 未找到文件
-        return -ENOENT;
+    struct FCB *file = fh->inode->fcb;
+    if (file->metadata & META_DIRECTORY) {
+        ret = -EISDIR;
+    } else if (size > INT32_MAX) {
+        // 因为返回值是 4 个字节的 int 类型，那么读入的字节数不能超过 int 型最大值
+        // 否则返回值溢出，和负值的错误码冲突
+        ret = -EINVAL;
+    } else {
+        // 不处理读写权限
+        ret = (int) read_file(file, buf, offset, size, fh);
+    }
 
-    int ret;
-    if (fi->flags & O_TRUNC && 0 != (ret = _truncate(file, 0)))
-        return ret;
+    pthread_rwlock_unlock(&fh->inode->lock);
 
-    return 0;  // 找到文件了
+    if (handle_of(fi) == NULL)
+        handle_close(fh);
+
+    return ret;
 }
 
-int my_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+int my_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    fuse_log(FUSE_LOG_INFO, "create: %s\n", path);
+    fuse_log(FUSE_LOG_INFO, "write: %s\n", path);
 
-    (void) mode;
-    (void) fi;
+    struct FileHandle *fh = handle_of(fi);
 
-    if (strcmp(path, "/") == 0)
-        return -EINVAL;
+    if (fh == NULL) {
+        if (strcmp(path, "/") == 0)
+            return -EISDIR;
 
-    int err_code;
-    struct FCB *file = find_file(g_root_dir, ROOT_ENTRIES, path, &err_code);
-    if (err_code != 0 && err_code != -ENOENT)
-        return err_code;
+        int err_code = open_path(path, &fh);
+        if (err_code != 0)
+            return err_code;
+    }
 
-    if (file != NULL)  // 文件已存在
-        return -EEXIST;
+    int ret;
 
-    char *tmp = strdup(path);
-    char *parent = tmp; // 父目录
-    char *name = strrchr(tmp, '/');
-    if (name != NULL)
-        *name++ = '\0';
+    pthread_rwlock_rdlock(&g_cut_lock);
+    pthread_rwlock_wrlock(&fh->inode->lock);
+
+    struct FCB *file = fh->inode->fcb;
+    if (file->metadata & META_DIRECTORY)
+        ret = -EISDIR;
+    else if (size > INT32_MAX)
+        ret = -EINVAL;
     else
-        name = tmp;
+        ret = (int) write_file(file, buf, offset, size, fh);
 
-    if (!is_filename_available(name))
-        return -EINVAL;
+    pthread_rwlock_unlock(&fh->inode->lock);
 
-    if (*parent == '\0') { // 根目录
-        file = get_free_entry(g_root_dir, ROOT_ENTRIES);
-    } else {
-        struct FCB *dir_file = find_file(g_root_dir, ROOT_ENTRIES, parent, &err_code);
-        if (err_code != 0)
-            return err_code;
+    if (handle_of(fi) == NULL)
+        handle_close(fh);
 
-        uint16_t cur_cluster = dir_file->first_cluster;
-        uint32_t entries = CLUSTER_SIZE / sizeof(struct FCB);
+    pthread_rwlock_unlock(&g_cut_lock);
 
-        struct FCB *dir = NULL;
-        file = NULL;
-        while (is_cluster_inuse(cur_cluster) && file == NULL) {
-            dir = (struct FCB *) get_cluster(cur_cluster);
+//    if (fi->flags & O_APPEND)
+//        return ret;
+//
+//    // 仅仅是写，则表示覆盖
+//    int err;
+//    if (0 != (err = _truncate(file, offset + size)))
+//        return err;
 
-            assert(dir != NULL);
+    return ret;
+}
 
-            file = get_free_entry(dir, entries);
-            cur_cluster = g_fat[0][cur_cluster].cluster;
+/**
+ * 生成 read_buf 返回的数据
+ * 持有文件的读锁时把内容拷贝一次到新分配的缓冲区。不直接引用 mmap 的镜像文件：
+ * splice 发生在返回之后，那时簇可能已经被截断释放、分配给了别的文件
+ * @param bufp 保存生成的 bufvec（由 libfuse 释放）
+ * @return 成功返回 0，内存不足返回 -ENOMEM，读取失败返回 -errno
+ */
+static int make_read_buf(const struct FCB *file, uint32_t offset, uint32_t length, struct FileHandle *fh,
+                         struct fuse_bufvec **bufp)
+{
+    struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec));
+    if (bufv == NULL)
+        return -ENOMEM;
+
+    *bufv = FUSE_BUFVEC_INIT(length);
+    if (length > 0) {
+        bufv->buf[0].mem = malloc(length);
+        if (bufv->buf[0].mem == NULL) {
+            free(bufv);
+            return -ENOMEM;
         }
 
-        if (file == NULL) { // 给目录文件扩个容
-            file = (struct FCB *) get_cluster(file_new_cluster(dir_file, 1));
+        long long n = read_file(file, bufv->buf[0].mem, offset, length, fh);
+        if (n < 0) {
+            free(bufv->buf[0].mem);
+            free(bufv);
+            return (int) n;
         }
     }
 
-    if (!file)  // 目录项满了
-        return -ENFILE;
-
-    memset(file, 0, sizeof(struct FCB));
-    memset(file->filename, ' ', MAX_FILENAME);
-    memset(file->extname, ' ', MAX_EXTNAME);
-    memcpy(file->filename, name, strlen(name));
-    file->first_cluster = CLUSTER_END;
-
+    *bufp = bufv;
     return 0;
 }
 
-int my_unlink(const char *path)
+int my_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    fuse_log(FUSE_LOG_INFO, "unlink: %s\n", path);
+    fuse_log(FUSE_LOG_INFO, "read_buf: %s\n", path);
 
-    int err_code;
-    struct FCB *file = find_file(g_root_dir, ROOT_ENTRIES, path, &err_code);
-    if (err_code != 0)
-        return err_code;
+    struct FileHandle *fh = handle_of(fi);
 
-    if ((file->metadata & META_VOLUME_LABEL))
-        return -ENOENT;
+    if (fh == NULL) {
+        if (strcmp(path, "/") == 0)
+            return -EISDIR;
 
-    if ((file->metadata & META_DIRECTORY))
-        return -EISDIR;
+        int err_code = open_path(path, &fh);
+        if (err_code != 0)
+            return err_code;
+    }
 
-    remove_file(file);
+    int ret = 0;
 
-    return 0;
-}
+    pthread_rwlock_rdlock(&fh->inode->lock);
 
-int my_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
-{
-    fuse_log(FUSE_LOG_INFO, "read: %s\n", path);
+    struct FCB *file = fh->inode->fcb;
+    if (file->metadata & META_DIRECTORY) {
+        ret = -EISDIR;
+    } else if (size > INT32_MAX) {
+        ret = -EINVAL;
+    } else {
+        uint32_t length = offset >= file->size ? 0 : clamp_read(file, offset, size);
+        ret = make_read_buf(file, offset, length, fh, bufp);
+    }
 
-    (void) fi;
+    pthread_rwlock_unlock(&fh->inode->lock);
 
-    if (strcmp(path, "/") == 0) {
-        return -EISDIR;
-    }
+    if (handle_of(fi) == NULL)
+        handle_close(fh);
 
-    int err_code;
-    struct FCB *file = find_file(g_root_dir, ROOT_ENTRIES, path, &err_code);
+    return ret;
+}
 
-    if (err_code != 0)
-        return err_code;
+/**
+ * write_buf 的访问函数：从 fuse 的缓冲区（可能是管道）直接读入簇中
+ */
+static int copy_from_buf(char *addr, uint32_t length, uint32_t pos, void *arg)
+{
+    struct fuse_bufvec *src = arg;
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(length);
 
-    if (file->metadata & META_DIRECTORY)
-        return -EISDIR;
+    (void) pos;
 
-    // 因为返回值是 4 个字节的 int 类型，那么读入的字节数不能超过 int 型最大值
-    // 否则返回值溢出，和负值的错误码冲突
-    if (size > INT32_MAX)
-        return -EINVAL;
+    dst.buf[0].mem = addr;
+    ssize_t n = fuse_buf_copy(&dst, src, 0);
+    if (n > 0)
+        image_mark_data(addr, n);
+
+    if (n < 0)
+        return (int) n;
 
-    // 不处理读写权限
-    return (int) read_file(file, buf, offset, size);
+    return (size_t) n == length ? 0 : -EIO;
 }
 
-int my_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+int my_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi)
 {
-    fuse_log(FUSE_LOG_INFO, "write: %s\n", path);
+    fuse_log(FUSE_LOG_INFO, "write_buf: %s\n", path);
 
-    if (strcmp(path, "/") == 0)
-        return -EISDIR;
+    struct FileHandle *fh = handle_of(fi);
 
-    int err_code;
-    struct FCB *file = find_file(g_root_dir, ROOT_ENTRIES, path, &err_code);
+    if (fh == NULL) {
+        if (strcmp(path, "/") == 0)
+            return -EISDIR;
 
-    if (err_code != 0)
-        return err_code;
+        int err_code = open_path(path, &fh);
+        if (err_code != 0)
+            return err_code;
+    }
+
+    size_t size = fuse_buf_size(buf);
+    int ret;
 
+    pthread_rwlock_rdlock(&g_cut_lock);
+    pthread_rwlock_wrlock(&fh->inode->lock);
+
+    struct FCB *file = fh->inode->fcb;
+    uint32_t old_size = file->size;
+    uint32_t old_count = get_cluster_count(file);
     if (file->metadata & META_DIRECTORY)
-        return -EISDIR;
+        ret = -EISDIR;
+    else if (size > INT32_MAX)
+        ret = -EINVAL;
+    else if (size == 0)         // 和 write_file 一样，空的写入不改变文件
+        ret = 0;
+    else if (offset > UINT32_MAX)
+        ret = -EFBIG;
+    else if ((ret = reserve_file(file, offset, size)) == 0
+             && (ret = for_each_run(file, offset, size, fh, copy_from_buf, buf, 1)) != 0)
+        cancel_reserve(file, old_size, old_count);
 
-    if (size > INT32_MAX)
-        return -EINVAL;
+    if (ret == 0)
+        ret = (int) size;
 
-    int ret = (int) write_file(file, buf, offset, size);
+    pthread_rwlock_unlock(&fh->inode->lock);
 
-//    if (fi->flags & O_APPEND)
-//        return ret;
-//
-//    // 仅仅是写，则表示覆盖
-//    int err;
-//    if (0 != (err = _truncate(file, offset + size)))
-//        return err;
+    if (handle_of(fi) == NULL)
+        handle_close(fh);
+
+    pthread_rwlock_unlock(&g_cut_lock);
 
     return ret;
 }
@@ -475,14 +1300,40 @@ int my_flush(const char *path, struct fuse_file_info *fi)
 
     (void) fi;
 
-    return 0;
+    // 打开了日志时元数据要先提交到日志，不能直接写回原处
+    if (journal_is_open())
+        return commit(0);
+
+    // 只写回改动过的扇区
+    return image_flush(0);
+}
+
+int my_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    fuse_log(FUSE_LOG_INFO, "fsync: %s\n", path);
+
+    (void) datasync;
+    (void) fi;
+
+    // 打开了日志时只需文件数据和日志落盘，元数据写回原处不用等
+    if (journal_is_open())
+        return commit(1);
+
+    return image_flush(1);
 }
 
 int my_release(const char *path, struct fuse_file_info *fi)
 {
     fuse_log(FUSE_LOG_INFO, "release: %s\n", path);
 
-    (void) fi;
+    struct FileHandle *fh = handle_of(fi);
+    if (fh != NULL) {
+        // 最后一次关闭已删除的文件会释放它的簇
+        pthread_rwlock_rdlock(&g_cut_lock);
+        handle_close(fh);
+        pthread_rwlock_unlock(&g_cut_lock);
+        fi->fh = 0;
+    }
 
     return 0;
 }
@@ -491,100 +1342,172 @@ int my_truncate(const char *path, off_t offset, struct fuse_file_info *fi)
 {
     fuse_log(FUSE_LOG_INFO, "truncate: %s\n", path);
 
-    (void) fi;
+    struct FileHandle *fh = handle_of(fi);
+    if (fh == NULL) {
+        int err_code = open_path(path, &fh);
+        if (err_code != 0)
+            return err_code;
+    }
 
-    int err_code;
-    struct FCB *file = find_file(g_root_dir, ROOT_ENTRIES, path, &err_code);
+    pthread_rwlock_rdlock(&g_cut_lock);
+    pthread_rwlock_wrlock(&fh->inode->lock);
+    int ret = _truncate(fh->inode->fcb, offset);
+    pthread_rwlock_unlock(&fh->inode->lock);
 
-    if (err_code != 0)
-        return err_code;
+    if (handle_of(fi) == NULL)
+        handle_close(fh);
+
+    pthread_rwlock_unlock(&g_cut_lock);
 
-    return _truncate(file, offset);
+    return ret;
 }
 
-int my_rename(const char *name, const char *new_name, unsigned int flags)
+int my_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
 {
-    fuse_log(FUSE_LOG_INFO, "rename: %s->%s\n", name, new_name);
+    fuse_log(FUSE_LOG_INFO, "fallocate: %s\n", path);
 
-    (void)flags;
+    struct FileHandle *fh = handle_of(fi);
+    if (fh == NULL) {
+        int err_code = open_path(path, &fh);
+        if (err_code != 0)
+            return err_code;
+    }
+
+    pthread_rwlock_rdlock(&g_cut_lock);
+    pthread_rwlock_wrlock(&fh->inode->lock);
+    int ret = _fallocate(fh->inode->fcb, mode, offset, length, handle_of(fi));
+    pthread_rwlock_unlock(&fh->inode->lock);
+
+    if (handle_of(fi) == NULL)
+        handle_close(fh);
+
+    pthread_rwlock_unlock(&g_cut_lock);
+
+    return ret;
+}
+
+/**
+ * 重命名后更新路径缓存
+ * @param name 原路径
+ * @param new_name 新路径
+ * @param new_file 新的目录项
+ */
+static void rename_dcache(const char *name, const char *new_name, struct FCB *new_file)
+{
+    // 目录下的子路径全部变了，被覆盖的空目录下也可能有负缓存
+    if (new_file->metadata & META_DIRECTORY) {
+        dcache_invalidate_tree(name);
+        dcache_invalidate_tree(new_name);
+    }
+
+    dcache_insert(name, NULL);
+    dcache_insert(new_name, new_file);
+}
+
+/**
+ * 重命名，调用者持有目录树的写锁
+ */
+static int rename_locked(const char *name, const char *new_name)
+{
     int err_code, new_err_code;
-    struct FCB *file = find_file(g_root_dir, ROOT_ENTRIES, name, &err_code);
-    struct FCB *new_file = find_file(g_root_dir, ROOT_ENTRIES, new_name, &new_err_code);
+    struct FCB *file = lookup_path(name, &err_code);
+    if (err_code != 0)
+        return err_code;
+
+    struct FCB *new_file = lookup_path(new_name, &new_err_code);
+    if (new_file == file)
+        return 0;
 
     if (new_file != NULL)
     {
-        if ((file->metadata & META_DIRECTORY) == META_DIRECTORY && !is_directory_empty(new_file))
+        int empty = (new_file->metadata & META_DIRECTORY) ? is_directory_empty(new_file) : 1;
+        if (empty < 0)
+            return empty;
+        if (!empty)
             return -ENOTEMPTY;
         else
         {
-            release_cluster(new_file->first_cluster);
+            if (new_file->metadata & META_DIRECTORY)
+                dir_index_drop(new_file->first_cluster);
+
+            // 被覆盖的文件若仍被打开，等最后一次关闭时再释放
+            if (!inode_detach(new_file))
+                release_cluster(new_file->first_cluster);
+
+            // 文件可能正通过句柄被读写，拷贝目录项时要锁住
+            struct Inode *inode = inode_lock(file);
 
             char tmp[MAX_FILENAME+MAX_EXTNAME];
             memcpy(tmp, new_file->filename, MAX_FILENAME + MAX_EXTNAME);
             memcpy(new_file, file, sizeof(struct FCB));
             memcpy(new_file->filename, tmp, MAX_FILENAME + MAX_EXTNAME);
 
+            remove_from_parent(name, file);
             file->filename[0] = FILE_DELETE;
+            inode_move(file, new_file);
+            inode_unlock(inode);
+
+            image_mark_dirty(new_file, sizeof(struct FCB));
+            image_mark_dirty(file, sizeof(struct FCB));
+            rename_dcache(name, new_name, new_file);
             return 0;
         }
     }
     else
     {
-        char *tmp = strdup(new_name);
-        char *new_parent = tmp; // 父目录
-        char *new_filename = strrchr(tmp, '/');
-        if (new_filename != NULL)
-            *new_filename++ = '\0';
-        else
-            new_filename = tmp;
-
+        const char *new_filename = strrchr(new_name, '/') + 1;
         if (!is_filename_available(new_filename))
             return -EINVAL;
 
-        if (*new_parent == '\0')
-        { // 根目录
-            new_file = get_free_entry(g_root_dir, ROOT_ENTRIES);
-        }
-        else
-        {
-            struct FCB *dir_file = find_file(g_root_dir, ROOT_ENTRIES, new_parent, &err_code);
-            if (err_code != 0)
-                return err_code;
-
-            uint16_t cur_cluster = dir_file->first_cluster;
-            uint32_t entries = CLUSTER_SIZE / sizeof(struct FCB);
-
-            struct FCB *dir = NULL;
-            new_file = NULL;
-            while (is_cluster_inuse(cur_cluster) && new_file == NULL)
-            {
-                dir = (struct FCB *)get_cluster(cur_cluster);
-
-                assert(dir != NULL);
-
-                new_file = get_free_entry(dir, entries);
-                cur_cluster = g_fat[0][cur_cluster].cluster;
-            }
+        struct FCB *dir_file;
+        struct DirIndex *index;
+        err_code = lock_parent(new_name, &dir_file, &index);
+        if (err_code != 0)
+            return err_code;
 
-            if (new_file == NULL)
-            { // 给目录文件扩个容
-                new_file = (struct FCB *)get_cluster(file_new_cluster(dir_file, 1));
-            }
+        new_file = alloc_entry(dir_file, index, &err_code);
+        if (!new_file) { // 目录项满了或读取失败
+            dir_index_unlock(index);
+            return err_code;
         }
 
-        if (!new_file) // 目录项满了
-            return -ENFILE;
+        struct Inode *inode = inode_lock(file);
 
         memcpy(new_file, file, sizeof(struct FCB));
         memset(new_file->filename, ' ', MAX_FILENAME + MAX_EXTNAME);
         memcpy(new_file->filename, new_filename, strlen(new_filename));
+        dir_index_insert(index, new_file);
+        dir_index_unlock(index);
 
+        remove_from_parent(name, file);
         file->filename[0] = FILE_DELETE;
+        inode_move(file, new_file);
+        inode_unlock(inode);
+
+        image_mark_dirty(new_file, sizeof(struct FCB));
+        image_mark_dirty(file, sizeof(struct FCB));
+        rename_dcache(name, new_name, new_file);
         return 0;
     }
     return -EFAULT;
 }
 
+int my_rename(const char *name, const char *new_name, unsigned int flags)
+{
+    fuse_log(FUSE_LOG_INFO, "rename: %s->%s\n", name, new_name);
+
+    (void)flags;
+
+    // 目录改名会影响整棵子树的路径，直接独占整个目录树
+    pthread_rwlock_rdlock(&g_cut_lock);
+    pthread_rwlock_wrlock(&g_ns_lock);
+    int ret = rename_locked(name, new_name);
+    pthread_rwlock_unlock(&g_ns_lock);
+    pthread_rwlock_unlock(&g_cut_lock);
+
+    return ret;
+}
+
 int my_chmod(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
     fuse_log(FUSE_LOG_INFO, "chmod: %s\n", path);
@@ -615,9 +1538,9 @@ int my_statfs(const char *path, struct statvfs *sfs)
     memset(sfs, 0, sizeof(struct statvfs));
     sfs->f_bsize = CLUSTER_SIZE;
     sfs->f_frsize = sfs->f_bsize;
-    sfs->f_blocks = DRIVE_SIZE / sfs->f_bsize;
+    sfs->f_blocks = g_geo.cluster_end - CLUSTER_MIN;
     sfs->f_namemax = MAX_FILENAME;
-    sfs->f_bfree = (DRIVE_SIZE - HEADER_SECTORS * BYTES_PER_SECTOR) / sfs->f_bsize;
+    sfs->f_bfree = alloc_free_count();
     sfs->f_bavail = sfs->f_bfree;
     sfs->f_fsid = 0x1234;
 
@@ -632,87 +1555,43 @@ int my_opendir(const char *path, struct fuse_file_info *fi)
 
 
     int err_code;
-    struct FCB *file = find_file(g_root_dir, ROOT_ENTRIES, path, &err_code);
+    pthread_rwlock_rdlock(&g_ns_lock);
+    struct FCB *file = lookup_path(path, &err_code);
 
-    if (err_code != 0)
-        return err_code;
-
-    if ((file->metadata & META_VOLUME_LABEL))
-        return -ENOENT;  // 未找到文件
+    if (err_code == 0 && (file->metadata & META_VOLUME_LABEL))
+        err_code = -ENOENT;  // 未找到文件
+    pthread_rwlock_unlock(&g_ns_lock);
 
-    return 0;  // 找到文件了
+    return err_code;
 }
 
-int my_mkdir(const char *path, mode_t mode)
+/**
+ * 在分配到的目录项上建立新目录，调用者持有父目录锁
+ * @param file 分配到的目录项
+ * @param name 目录名
+ * @param index 父目录的索引
+ * @return 成功返回 0，没有空间时把目录项还给父目录并返回 -ENOSPC
+ */
+static int make_directory(struct FCB *file, const char *name, struct DirIndex *index)
 {
-    fuse_log(FUSE_LOG_INFO, "mkdir: %s\n", path);
-
-    (void) mode;
-
-    if (strcmp(path, "/") == 0)
-        return -EINVAL;
-
-    int err_code;
-    struct FCB *file = find_file(g_root_dir, ROOT_ENTRIES, path, &err_code);
-
-    // 路径中间有不存在的目录等错误
-    if (err_code != 0 && err_code != -ENOENT)
-        return err_code;
-
-    if (file != NULL)  // 文件已存在
-        return -EEXIST;
-
-    char *tmp = strdup(path);
-    char *parent = tmp; // 父目录
-    char *name = strrchr(tmp, '/');
-    if (name != NULL)
-        *name++ = '\0';
-    else
-        name = tmp;
-
-    if (!is_filename_available(name))
-        return -EINVAL;
-
-    if (*parent == '\0') { // 根目录
-        file = get_free_entry(g_root_dir, ROOT_ENTRIES);
-    } else {
-        struct FCB *dir_file = find_file(g_root_dir, ROOT_ENTRIES, parent, &err_code);
-        if (err_code != 0)
-            return err_code;
-
-        uint16_t cur_cluster = dir_file->first_cluster;
-        uint32_t entries = CLUSTER_SIZE / sizeof(struct FCB);
-
-        struct FCB *dir = NULL;
-        file = NULL;
-        while (is_cluster_inuse(cur_cluster) && file == NULL) {
-            dir = (struct FCB *) get_cluster(cur_cluster);
-
-            assert(dir != NULL);
-
-            file = get_free_entry(dir, entries);
-            cur_cluster = g_fat[0][cur_cluster].cluster;
-        }
-
-        if (file == NULL) { // 给目录文件扩个容
-            file = (struct FCB *) get_cluster(file_new_cluster(dir_file, 1));
-        }
-    }
-
-    if (!file)  // 目录项满了
-        return -ENFILE;
-
     memset(file, 0, sizeof(struct FCB));
     memset(file->filename, ' ', MAX_FILENAME + MAX_EXTNAME);
     file->first_cluster = CLUSTER_END;
     file->metadata = (file->metadata | META_DIRECTORY);
 
-    struct FCB *item = (struct FCB *) get_cluster(file_new_cluster(file, 1));
-    if (item == NULL)
-        return -ENOSPC;
+    // 新簇已经常驻内存
+    int cluster_num = file_new_cluster(file, 1, 0, 0);
+    struct FCB *item = cluster_num < 0 ? NULL : (struct FCB *) get_cluster(cluster_num);
+    if (item == NULL) {  // 目录项还给父目录
+        if (cluster_num >= 0)
+            release_cluster(cluster_num);
+        image_mark_dirty(file, sizeof(struct FCB));
+        dir_index_remove(index, file);
+        return cluster_num < 0 ? cluster_num : -EIO;
+    }
 
     // 设置当前目录 .
-    memset(item[0].filename, ' ', MAX_EXTNAME + MAX_EXTNAME);
+    memset(item[0].filename, ' ', MAX_FILENAME + MAX_EXTNAME);
     memcpy(item[0].filename, ".", 1);
     item[0].first_cluster = file->first_cluster;
     item[0].metadata |= META_DIRECTORY;
@@ -721,17 +1600,63 @@ int my_mkdir(const char *path, mode_t mode)
     memcpy(&item[1], &item[0], sizeof(struct FCB));
     memcpy(item[1].filename, "..", 2);
     item[1].first_cluster = 0;
+    image_mark_dirty(item, 2 * sizeof(struct FCB));
 
     memcpy(file->filename, name, strlen(name));
+    image_mark_dirty(file, sizeof(struct FCB));
+    dir_index_insert(index, file);
     return 0;
 }
 
-int my_rmdir(const char *path)
+int my_mkdir(const char *path, mode_t mode)
 {
-    fuse_log(FUSE_LOG_INFO, "rmdir: %s\n", path);
+    fuse_log(FUSE_LOG_INFO, "mkdir: %s\n", path);
+
+    (void) mode;
+
+    if (strcmp(path, "/") == 0)
+        return -EINVAL;
+
+    const char *name = strrchr(path, '/') + 1;
+    if (!is_filename_available(name))
+        return -EINVAL;
+
+    pthread_rwlock_rdlock(&g_cut_lock);
+    pthread_rwlock_rdlock(&g_ns_lock);
+
+    // 路径中间有不存在的目录等错误
+    struct FCB *dir_file;
+    struct DirIndex *index;
+    int err_code = lock_parent(path, &dir_file, &index);
+    if (err_code != 0) {
+        pthread_rwlock_unlock(&g_ns_lock);
+        pthread_rwlock_unlock(&g_cut_lock);
+        return err_code;
+    }
+
+    struct FCB *file = lookup_child(index, path);
+    if (file != NULL)  // 文件已存在
+        err_code = -EEXIST;
+    else if ((file = alloc_entry(dir_file, index, &err_code)) != NULL)  // 目录项满了或读取失败时返回 NULL
+        err_code = make_directory(file, name, index);
+
+    if (err_code == 0)
+        dcache_insert(path, file);
 
+    dir_index_unlock(index);
+    pthread_rwlock_unlock(&g_ns_lock);
+    pthread_rwlock_unlock(&g_cut_lock);
+
+    return err_code;
+}
+
+/**
+ * 删除目录，调用者持有目录树的写锁
+ */
+static int rmdir_locked(const char *path)
+{
     int err_code;
-    struct FCB *file = find_file(g_root_dir, ROOT_ENTRIES, path, &err_code);
+    struct FCB *file = lookup_path(path, &err_code);
     if (err_code != 0)
         return err_code;
 
@@ -742,13 +1667,33 @@ int my_rmdir(const char *path)
         return -ENOTDIR;
 
     // 目录不为空不能删除
-    if (!is_directory_empty(file))
+    int empty = is_directory_empty(file);
+    if (empty < 0)
+        return empty;
+    if (!empty)
         return -ENOTEMPTY;
 
+    remove_from_parent(path, file);
+    dir_index_drop(file->first_cluster);
     remove_file(file);
+    dcache_insert(path, NULL);
     return 0;
 }
 
+int my_rmdir(const char *path)
+{
+    fuse_log(FUSE_LOG_INFO, "rmdir: %s\n", path);
+
+    // 要丢弃目录的索引，不能有线程在使用它
+    pthread_rwlock_rdlock(&g_cut_lock);
+    pthread_rwlock_wrlock(&g_ns_lock);
+    int ret = rmdir_locked(path);
+    pthread_rwlock_unlock(&g_ns_lock);
+    pthread_rwlock_unlock(&g_cut_lock);
+
+    return ret;
+}
+
 int my_releasedir(const char *path, struct fuse_file_info *fi)
 {
 
@@ -760,15 +1705,53 @@ void my_destroy(void *private_data)
     (void) private_data;
 //    return;
 
+    alloc_destroy();
+    dcache_destroy();
+    dir_index_destroy();
+
+    if (g_checkpoint_running) {
+        pthread_mutex_lock(&g_checkpoint_lock);
+        g_checkpoint_running = 0;
+        pthread_cond_signal(&g_checkpoint_stop);
+        pthread_mutex_unlock(&g_checkpoint_lock);
+        pthread_join(g_checkpointer, NULL);
+
+        fuse_log(FUSE_LOG_INFO, "checkpoint: %llu checkpoints wrote %llu bytes, longest %.2f ms\n",
+                 (unsigned long long) g_checkpoint_count, (unsigned long long) g_checkpoint_bytes,
+                 g_checkpoint_max_ms);
+    }
+
+    // 等正在写的快照完成，之后的 SIGUSR1 不再处理
+    if (g_snapshot_running) {
+        signal(SIGUSR1, SIG_IGN);
+        __atomic_store_n(&g_snapshot_running, 0, __ATOMIC_RELEASE);
+        sem_post(&g_snapshot_request);
+        pthread_join(g_snapshotter, NULL);
+        sem_destroy(&g_snapshot_request);
+    }
+
+    // 最后一次提交到日志，image_close 写回并落盘之后清空日志
+    if (journal_is_open() && commit(1) != 0)
+        fuse_log(FUSE_LOG_ERR, "failed to commit the journal\n");
+
+    pthread_rwlock_destroy(&g_cut_lock);
+
+    struct ImageCacheStats stats;
+    image_cache_stats(&stats);
+    if (stats.limit != 0)
+        fuse_log(FUSE_LOG_INFO, "cache: %llu hits, %llu misses, %llu evictions (%llu written back), %zu/%zu blocks of %zu bytes\n",
+                 (unsigned long long) stats.hits, (unsigned long long) stats.misses,
+                 (unsigned long long) stats.evictions, (unsigned long long) stats.writebacks,
+                 stats.resident, stats.limit, stats.block_size);
+
     fuse_log(FUSE_LOG_INFO, "store data to file %s\n", opts.filename);
-    FILE *fp = fopen(opts.filename, "wb");
-    if (fp != NULL) {
-        fwrite(g_addr, 1, g_size, fp);
-        fclose(fp);
-    } else {
+    if (image_close() != 0) {
         fuse_log(FUSE_LOG_ERR, "failed to save data to file %s\n", opts.filename);
         abort();
     }
+
+    free(g_journal_path);
+    g_journal_path = NULL;
 }
 
 char *get_filename(const struct FCB *file)
@@ -788,16 +1771,29 @@ char *get_filename(const struct FCB *file)
     return filename;
 }
 
-char *get_cluster(uint32_t cluster_num)
+/**
+ * 簇在内存中的地址，按需载入时不保证已经读入
+ */
+static char *cluster_address(uint32_t cluster_num)
 {
     if (!is_cluster_inuse(cluster_num))
         return NULL;
 
     // 减 2 是因为数据区的第一个有效簇号是 2
-    char *cluster = ((char *) g_root_dir + (ROOT_ENTRIES * sizeof(struct FCB)) +
-                     (cluster_num - 2) * CLUSTER_SIZE);
+    char *cluster = ((char *) g_root_dir + (size_t) g_geo.root_sectors * g_geo.bytes_per_sector +
+                     (size_t) (cluster_num - 2) * CLUSTER_SIZE);
+
+    if (cluster + CLUSTER_SIZE > g_addr + g_size)
+        return NULL;
+
+    return cluster;
+}
+
+char *get_cluster(uint32_t cluster_num)
+{
+    char *cluster = cluster_address(cluster_num);
 
-    if (cluster > g_addr + g_size)
+    if (cluster != NULL && image_pin(cluster, CLUSTER_SIZE) != 0)
         return NULL;
 
     return cluster;
@@ -805,7 +1801,21 @@ char *get_cluster(uint32_t cluster_num)
 
 int is_cluster_inuse(uint32_t cluster_num)
 {
-    return CLUSTER_MIN <= cluster_num && cluster_num <= CLUSTER_MAX;
+    return CLUSTER_MIN <= cluster_num && cluster_num < g_geo.cluster_end;
+}
+
+uint16_t get_fat(uint32_t cluster_num)
+{
+    return g_fat[0][cluster_num].cluster;
+}
+
+void set_fat(uint32_t cluster_num, uint16_t value)
+{
+    // 所有 FAT 副本保持一致，别的工具读取哪一份都能得到相同的结果
+    for (uint32_t i = 0; i < g_geo.number_of_fat; i++) {
+        g_fat[i][cluster_num].cluster = value;
+        image_mark_dirty(&g_fat[i][cluster_num], sizeof(struct FAT));
+    }
 }
 
 int is_entry_end(const struct FCB *fcb)
@@ -849,151 +1859,443 @@ struct FCB *get_free_entry(struct FCB *dir, uint32_t entries)
     return NULL;
 }
 
-long long read_file(const struct FCB *fcb, void *buff, uint32_t offset, uint32_t length)
+struct FCB *alloc_entry(struct FCB *dir_file, struct DirIndex *index, int *error_code)
+{
+    *error_code = 0;
+
+    struct FCB *file = dir_index_alloc(index);
+    if (file == NULL && dir_file != NULL && index->full) { // 给目录文件扩个容
+        int cluster_num = file_new_cluster(dir_file, 1, 0, 0);
+        if (cluster_num < 0) {
+            *error_code = cluster_num;
+            return NULL;
+        }
+
+        dir_index_add_cluster(index, (uint16_t) cluster_num);
+        file = dir_index_alloc(index);
+    }
+
+    if (file == NULL)
+        *error_code = -ENFILE;
+
+    return file;
+}
+
+struct FCB *get_root_dir(void)
+{
+    return g_root_dir;
+}
+
+int for_each_run(const struct FCB *fcb, uint32_t offset, uint32_t length, struct FileHandle *fh,
+                 run_visitor visit, void *arg, int overwrite)
+{
+    // 定位到对应偏移的簇上
+    uint32_t index = offset / CLUSTER_SIZE;
+    uint16_t cur = seek_cluster(fcb, index, fh);
+    uint16_t last = cur;
+    uint32_t pos = 0;
+    offset %= CLUSTER_SIZE;
+
+    while (length > 0) {
+        // 物理上连续的簇作为一段
+        uint32_t count = get_contiguous_clusters(cur, (offset + length + CLUSTER_SIZE - 1) / CLUSTER_SIZE, &last);
+        uint32_t n = count * CLUSTER_SIZE - offset;
+        if (n > length)
+            n = length;
+
+        char *addr = cluster_address(cur);
+        assert(addr != NULL);
+
+        // 按需载入时，这一段只在访问期间保证在内存里
+        int ret = image_acquire(addr + offset, n, overwrite);
+        if (ret != 0)
+            return ret;
+
+        ret = visit(addr + offset, n, pos, arg);
+        image_release(addr + offset, n);
+        if (ret != 0)
+            return ret;
+
+        length -= n;
+        pos += n;
+
+        offset = 0;
+        index += count;
+        cur = g_fat[0][last].cluster;    // 下一个簇号
+    }
+
+    if (pos > 0)
+        update_cursor(fh, index - 1, last);
+
+    return 0;
+}
+
+static int copy_out(char *addr, uint32_t length, uint32_t pos, void *arg)
+{
+    memcpy((char *) arg + pos, addr, length);
+    return 0;
+}
+
+static int copy_in(char *addr, uint32_t length, uint32_t pos, void *arg)
+{
+    memcpy(addr, (const char *) arg + pos, length);
+    image_mark_data(addr, length);
+    return 0;
+}
+
+// copy_file_range 每次拷贝的最大长度
+#define COPY_CHUNK_SIZE (1 << 20)
+
+// copy_file_range 拷贝目标文件的一段时，源文件中对应的位置
+struct CopyRange {
+    const struct FCB *src;
+    uint32_t offset;                    // 源文件中对应目标范围起点的偏移
+    struct FileHandle *fh;              // 源文件的句柄
+};
+
+static int copy_from_file(char *addr, uint32_t length, uint32_t pos, void *arg)
+{
+    struct CopyRange *range = arg;
+
+    // 目标的一段连续簇和源文件的每一段连续簇的交集各拷贝一次
+    int ret = for_each_run(range->src, range->offset + pos, length, range->fh, copy_out, addr, 0);
+    if (ret == 0)
+        image_mark_data(addr, length);
+
+    return ret;
+}
+
+/**
+ * 在镜像内把源文件的一段拷贝到目标文件，调用者持有两个文件的锁
+ * @return 成功返回拷贝的字节数，失败返回错误码
+ */
+static ssize_t copy_range(struct FileHandle *in, off_t offset_in, struct FileHandle *out, off_t offset_out, size_t size)
 {
-    size_t pos = 0;
+    struct FCB *src = in->inode->fcb;
+    struct FCB *dst = out->inode->fcb;
+
+    if ((src->metadata & META_DIRECTORY) || (dst->metadata & META_DIRECTORY))
+        return -EISDIR;
 
-    if (offset == fcb->size || length == 0)
+    if (offset_in >= src->size || size == 0)
         return 0;
 
-    if (offset + length < offset)  // 溢出了
+    uint32_t length = src->size - (uint32_t) offset_in;
+    if (size < length)
+        length = (uint32_t) size;
+
+    if ((uint64_t) offset_out + length > UINT32_MAX)
+        return -EFBIG;
+
+    // 同一个文件里重叠的范围不能拷贝
+    if (src == dst && offset_in < offset_out + (off_t) length && offset_out < offset_in + (off_t) length)
         return -EINVAL;
 
-    if (length > fcb->size || offset + length > fcb->size) { // 超出文件大小
-        length = fcb->size - offset;
-    }
+    uint32_t old_size = dst->size;
+    uint32_t old_count = get_cluster_count(dst);
 
-    uint16_t cur_cluster_num = fcb->first_cluster;
+    // 目标的簇一次分配，完全被覆盖的不清零
+    int ret = reserve_file(dst, (uint32_t) offset_out, length);
+    if (ret != 0)
+        return ret;
 
-    // 定位到对应偏移的簇上
-    while (offset >= CLUSTER_SIZE) {
-        assert(is_cluster_inuse(cur_cluster_num));
-        cur_cluster_num = g_fat[0][cur_cluster_num].cluster;
-        offset -= CLUSTER_SIZE;
+    // 分段拷贝，按需载入时同时钉住的块不超过两段的大小
+    for (uint32_t done = 0; done < length; done += COPY_CHUNK_SIZE) {
+        uint32_t n = length - done < COPY_CHUNK_SIZE ? length - done : COPY_CHUNK_SIZE;
+        struct CopyRange range = {src, (uint32_t) offset_in + done, in};
+
+        ret = for_each_run(dst, (uint32_t) offset_out + done, n, out, copy_from_file, &range, 1);
+        if (ret != 0) {
+            cancel_reserve(dst, old_size, old_count);
+            return ret;
+        }
     }
 
-    char *src = get_cluster(cur_cluster_num);
-    assert(src != NULL);
+    return length;
+}
 
-    src += offset;
-    uint32_t n = CLUSTER_SIZE - offset;
-    while (length > CLUSTER_SIZE) {
-        memcpy(buff + pos, src, n);
-        length -= n;
-        pos += n;
+ssize_t my_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t offset_in, const char *path_out,
+                           struct fuse_file_info *fi_out, off_t offset_out, size_t size, int flags)
+{
+    fuse_log(FUSE_LOG_INFO, "copy_file_range: %s -> %s\n", path_in, path_out);
+
+    if (flags != 0 || offset_in < 0 || offset_out < 0)
+        return -EINVAL;
 
-        src = get_cluster(cur_cluster_num);
-        assert(src != NULL);
+    struct FileHandle *in = handle_of(fi_in);
+    struct FileHandle *out = handle_of(fi_out);
+    int err_code = 0;
 
-        cur_cluster_num = g_fat[0][cur_cluster_num].cluster;
-        n = CLUSTER_SIZE;
+    if (in == NULL)
+        err_code = strcmp(path_in, "/") == 0 ? -EISDIR : open_path(path_in, &in);
+    if (err_code == 0 && out == NULL)
+        err_code = strcmp(path_out, "/") == 0 ? -EISDIR : open_path(path_out, &out);
+
+    if (err_code != 0) {
+        if (in != NULL && handle_of(fi_in) == NULL)
+            handle_close(in);
+        return err_code;
+    }
+
+    // 源文件读锁、目标文件写锁，两个锁按地址顺序获取；同一个文件只加写锁
+    struct Inode *src = in->inode;
+    struct Inode *dst = out->inode;
+
+    pthread_rwlock_rdlock(&g_cut_lock);
+    if (src == dst) {
+        pthread_rwlock_wrlock(&dst->lock);
+    } else if (src < dst) {
+        pthread_rwlock_rdlock(&src->lock);
+        pthread_rwlock_wrlock(&dst->lock);
+    } else {
+        pthread_rwlock_wrlock(&dst->lock);
+        pthread_rwlock_rdlock(&src->lock);
     }
 
-    // 剩余不足一簇的数据
-    memcpy(buff + pos, src, length);
-    pos += length;
+    ssize_t ret = copy_range(in, offset_in, out, offset_out, size);
+
+    pthread_rwlock_unlock(&dst->lock);
+    if (src != dst)
+        pthread_rwlock_unlock(&src->lock);
+
+    if (handle_of(fi_in) == NULL)
+        handle_close(in);
+    if (handle_of(fi_out) == NULL)
+        handle_close(out);
 
-    return pos;
+    pthread_rwlock_unlock(&g_cut_lock);
+
+    return ret;
+}
+
+uint32_t clamp_read(const struct FCB *fcb, uint32_t offset, uint32_t length)
+{
+    if (offset >= fcb->size)
+        return 0;
+
+    if (length > fcb->size - offset) // 超出文件大小
+        length = fcb->size - offset;
+
+    return length;
 }
 
-long long write_file(struct FCB *fcb, const void *buff, uint32_t offset, uint32_t length)
+long long read_file(const struct FCB *fcb, void *buff, uint32_t offset, uint32_t length, struct FileHandle *fh)
 {
+    length = clamp_read(fcb, offset, length);
     if (length == 0)
         return 0;
 
+    int ret = for_each_run(fcb, offset, length, fh, copy_out, buff, 0);
+    if (ret != 0)
+        return ret;
+
+    return length;
+}
+
+static int zero_in(char *addr, uint32_t length, uint32_t pos, void *arg)
+{
+    (void) pos;
+    (void) arg;
+    image_zero(addr, length);
+    return 0;
+}
+
+/**
+ * 文件要从当前大小增长到 end 时，把 [size, end) 中已经分配了簇的部分清零
+ * 截短时最后一个簇里超出新大小的内容没有清除，增长之后这部分必须读到 0
+ * @param fcb 文件的 FCB 结构体指针
+ * @param end 增长后的大小
+ * @return 成功返回 0，读入失败返回 -errno
+ */
+static int zero_gap(struct FCB *fcb, uint32_t end)
+{
+    uint64_t allocated = (uint64_t) get_cluster_count(fcb) * CLUSTER_SIZE;
+    if (end > allocated)
+        end = (uint32_t) allocated;
+
+    if (end <= fcb->size)
+        return 0;
+
+    return for_each_run(fcb, fcb->size, end - fcb->size, NULL, zero_in, NULL, 1);
+}
+
+int reserve_file(struct FCB *fcb, uint32_t offset, uint32_t length)
+{
     if (offset + length < offset)  // 溢出了
         return -EINVAL;
 
+    // 跳过的部分读出来是 0
+    if (offset > fcb->size) {
+        int ret = zero_gap(fcb, offset);
+        if (ret != 0)
+            return ret;
+    }
+
     // 若文件为空，写入数据后占用簇的数量
     uint32_t write_cluster_count = (offset + length + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
 
     // 原有文件大小占用的簇的数量
     uint32_t now_cluster_count = get_cluster_count(fcb);
 
-    // 若文件为空，写入数据后文件的大小
-    uint32_t write_size = offset + length;
-
-    // 原有文件大小
-    uint32_t now_size = fcb->size;
-
     // 需要扩容
     if (write_cluster_count > now_cluster_count) {
-        if (CLUSTER_END == file_new_cluster(fcb, write_cluster_count - now_cluster_count))
-            return -ENOSPC;
+        int ret = file_new_cluster(fcb, write_cluster_count - now_cluster_count, offset, length);
+        if (ret < 0)
+            return ret;
     }
 
     // 文件大小需要更改
-    if (write_size > now_size)
-        fcb->size = write_size;
+    if (offset + length > fcb->size) {
+        fcb->size = offset + length;
+        image_mark_dirty(fcb, sizeof(struct FCB));
+    }
+
+    return 0;
+}
 
+void cancel_reserve(struct FCB *fcb, uint32_t size, uint32_t clusters)
+{
+    if (get_cluster_count(fcb) > clusters)
+        adjust_cluster_count(fcb, clusters);
+
+    if (fcb->size != size) {
+        fcb->size = size;
+        image_mark_dirty(fcb, sizeof(struct FCB));
+    }
+}
+
+long long write_file(struct FCB *fcb, const void *buff, uint32_t offset, uint32_t length, struct FileHandle *fh)
+{
+    if (length == 0)
+        return 0;
+
+    uint32_t old_size = fcb->size;
+    uint32_t old_count = get_cluster_count(fcb);
+
+    int ret = reserve_file(fcb, offset, length);
+    if (ret != 0)
+        return ret;
+
+    ret = for_each_run(fcb, offset, length, fh, copy_in, (void *) buff, 1);
+    if (ret != 0) {
+        cancel_reserve(fcb, old_size, old_count);
+        return ret;
+    }
+
+    return length;
+}
+
+uint16_t seek_cluster(const struct FCB *fcb, uint32_t index, struct FileHandle *fh)
+{
+    uint32_t i = 0;
     uint16_t cur = fcb->first_cluster;
+    uint64_t cursor = fh == NULL ? 0 : __atomic_load_n(&fh->cursor, __ATOMIC_RELAXED);
+
+    if (fh != NULL && CURSOR_GEN(cursor) == fh->inode->gen && is_cluster_inuse(CURSOR_CLUSTER(cursor)) &&
+        CURSOR_INDEX(cursor) <= index && index - CURSOR_INDEX(cursor) <= 1) {
+        // 顺序访问：目标就是游标所在的簇或下一个簇
+        i = CURSOR_INDEX(cursor);
+        cur = CURSOR_CLUSTER(cursor);
+    } else if (fh != NULL) {
+        // 随机访问：查区间映射，第一次访问时建立，多个读者同时访问时只建立一次
+        struct Inode *inode = fh->inode;
+        struct ExtentMap *map = &inode->map;
+        if (!__atomic_load_n(&map->valid, __ATOMIC_ACQUIRE)) {
+            pthread_mutex_lock(&inode->map_lock);
+            if (!map->valid)
+                extent_map_build(map, fcb->first_cluster);
+            pthread_mutex_unlock(&inode->map_lock);
+        }
+
+        if (__atomic_load_n(&map->valid, __ATOMIC_ACQUIRE)) {
+            if (!extent_map_lookup(map, index, &cur))
+                cur = CLUSTER_END;
+            return cur;
+        }
+    }
 
-    // 定位到偏移对应的起始簇
-    while (offset >= CLUSTER_SIZE) {
+    while (i < index) {
         assert(is_cluster_inuse(cur));
 
         cur = g_fat[0][cur].cluster;
-        offset -= CLUSTER_SIZE;
+        i++;
     }
 
-    size_t pos = 0;
-    char *dst = get_cluster(cur);
-    assert(dst != NULL);
+    return cur;
+}
 
-    dst += offset;
+void update_cursor(struct FileHandle *fh, uint32_t index, uint16_t cluster_num)
+{
+    if (fh == NULL)
+        return;
 
-    uint32_t n = CLUSTER_SIZE - offset;
+    __atomic_store_n(&fh->cursor, CURSOR_PACK(fh->inode->gen, index, cluster_num), __ATOMIC_RELAXED);
+}
 
-    while (length > CLUSTER_SIZE) {
-        memcpy(dst, buff + pos, n);
-        length -= n;
-        pos += n;
+uint32_t get_contiguous_clusters(uint16_t cluster_num, uint32_t max_count, uint16_t *last)
+{
+    uint32_t count = 1;
 
-        cur = g_fat[0][cur].cluster;
-        dst = get_cluster(cur);
-        assert(dst != NULL);
+    assert(is_cluster_inuse(cluster_num));
 
-        n = CLUSTER_SIZE;
+    while (count < max_count && g_fat[0][cluster_num].cluster == cluster_num + 1) {
+        cluster_num++;
+        count++;
     }
 
-    // 剩下不足一簇的数据
-    memcpy(dst, buff + pos, length);
-    pos += length;
-
-    return pos;
+    *last = cluster_num;
+    return count;
 }
 
-uint16_t get_free_cluster_num(uint32_t count)
+uint16_t get_free_cluster_num(uint32_t count, uint16_t hint)
 {
-    if (count == 0)
+    uint16_t first = CLUSTER_END;
+    uint16_t prev = CLUSTER_END;
+
+    // 检查数量和分配之间不能被其他线程插进来
+    alloc_lock();
+
+    if (count == 0 || count > alloc_free_count()) {
+        alloc_unlock();
         return CLUSTER_END;
+    }
 
-    uint16_t first = CLUSTER_END;
+    // 按连续区间分配，簇链从前往后链接
+    while (count > 0) {
+        uint32_t got = 0;
+        uint16_t start = alloc_extent(prev == CLUSTER_END ? hint : prev + 1, count, &got);
+        assert(start != CLUSTER_END);
 
-    while (count--) {
-        size_t i;
-        for (i = 0; i < SECTORS_PER_FAT * BYTES_PER_SECTOR / sizeof(struct FAT); i++) {
-            if (g_fat[0][i].cluster == CLUSTER_FREE && get_cluster(i) != NULL) {
-                g_fat[0][i].cluster = first;
-                break;
-            }
-        }
+        if (prev == CLUSTER_END)
+            first = start;
+        else
+            set_fat(prev, start);
 
-        if (i == SECTORS_PER_FAT * BYTES_PER_SECTOR / sizeof(struct FAT)) {
-            // 不足够分配所需的簇，释放之前分配的簇
-            release_cluster(first);
-            return CLUSTER_END;
+        for (uint32_t i = 0; i + 1 < got; i++) {
+            set_fat(start + i, start + i + 1);
         }
 
-        first = i;
+        prev = start + got - 1;
+        count -= got;
     }
 
+    set_fat(prev, CLUSTER_END);
+    alloc_unlock();
 
     return first;
 }
 
 int is_directory_empty(const struct FCB *file)
 {
+    int err_code;
+    struct DirIndex *index = dir_index_get(file, &err_code);
+    if (index != NULL)
+        return index->live == 0;
+
+    // 内存不足时逐项检查
+    if (err_code != -ENOMEM)
+        return err_code;
+
     uint32_t entries = CLUSTER_SIZE / sizeof(struct FCB);
     uint16_t cur_cluster = file->first_cluster;
 
@@ -1001,7 +2303,8 @@ int is_directory_empty(const struct FCB *file)
     int stop = 0;
     while (is_cluster_inuse(cur_cluster) && !stop) {
         dir = (struct FCB *) get_cluster(cur_cluster);
-        assert(dir != NULL);
+        if (dir == NULL)
+            return -EIO;
 
         for (size_t i = 0; i < entries; i++) {
             if (is_entry_end(&dir[i])) {
@@ -1019,32 +2322,103 @@ int is_directory_empty(const struct FCB *file)
     return 1;
 }
 
-uint16_t file_new_cluster(struct FCB *file, uint32_t count)
+/**
+ * 找到文件的最后一个簇并数出簇的数量
+ * 打开的文件缓存在 inode 里，只有第一次沿着簇链走一遍，之后追加写不再随文件变大而变慢
+ * @param file 文件对应的 FCB 指针
+ * @param inode 文件打开时的 inode，可为 NULL
+ * @param tail 保存最后一个簇的簇号，文件没有簇时为 CLUSTER_END
+ * @return 返回簇的数量
+ */
+static uint32_t chain_end(const struct FCB *file, struct Inode *inode, uint16_t *tail)
+{
+    *tail = CLUSTER_END;
+    if (!is_cluster_inuse(file->first_cluster))
+        return 0;
+
+    if (inode != NULL && is_cluster_inuse(inode->tail)) {
+        *tail = inode->tail;
+        return inode->clusters;
+    }
+
+    uint16_t cur = file->first_cluster;
+    uint32_t count = 1;
+    while (is_cluster_inuse(g_fat[0][cur].cluster)) {
+        cur = g_fat[0][cur].cluster;
+        count++;
+    }
+
+    if (inode != NULL) {
+        inode->tail = cur;
+        inode->clusters = count;
+    }
+
+    *tail = cur;
+    return count;
+}
+
+int file_new_cluster(struct FCB *file, uint32_t count, uint32_t offset, uint32_t length)
 {
+    // 找到文件的最后一个簇，新的簇尽量紧接着它分配
+    struct Inode *inode = inode_find(file);
+    uint16_t tail;
+    uint32_t old_count = chain_end(file, inode, &tail);
+
     // 分配新的簇，并初始化
-    uint16_t new_cluster = get_free_cluster_num(count);
+    uint16_t new_cluster = get_free_cluster_num(count, tail == CLUSTER_END ? CLUSTER_END : tail + 1);
     if (new_cluster == CLUSTER_END)  // 没有空间可用了
-        return CLUSTER_END;
+        return -ENOSPC;
 
+    // 先清零，失败时新的簇还没链接到文件上，直接还回去
     uint16_t cur = new_cluster;
-    char *p = NULL;
-    while (is_cluster_inuse(cur)) {
-        p = get_cluster(cur);
+    uint64_t pos = (uint64_t) old_count * CLUSTER_SIZE;  // 新簇在文件中的偏移
+    for (; is_cluster_inuse(cur); cur = g_fat[0][cur].cluster, pos += CLUSTER_SIZE) {
+        // 调用者马上会写满的簇不用先清零，写入会标记修改
+        if (pos >= offset && pos + CLUSTER_SIZE <= (uint64_t) offset + length)
+            continue;
+
+        char *p = cluster_address(cur);
         assert(p != NULL);
-        memset(p, 0, CLUSTER_SIZE);
 
-        cur = g_fat[0][cur].cluster;
+        int ret;
+        if (file->metadata & META_DIRECTORY) {  // 目录的新簇也是元数据，和 get_cluster 一样一直常驻
+            ret = image_pin(p, CLUSTER_SIZE);
+            if (ret == 0) {
+                memset(p, 0, CLUSTER_SIZE);
+                image_mark_dirty(p, CLUSTER_SIZE);
+            }
+        } else {  // 文件的新簇换成零页，扩展到很大时不用一次写满内存；整个簇都被清零，按需载入时不用读出旧的内容
+            ret = image_acquire(p, CLUSTER_SIZE, 1);
+            if (ret == 0) {
+                image_zero(p, CLUSTER_SIZE);
+                image_release(p, CLUSTER_SIZE);
+            }
+        }
+
+        if (ret != 0) {
+            release_cluster(new_cluster);
+            return ret;
+        }
     }
 
-    if (is_cluster_inuse(file->first_cluster)) {
-        cur = file->first_cluster;
+    uint16_t new_tail = new_cluster;
+    for (cur = new_cluster; is_cluster_inuse(cur); cur = g_fat[0][cur].cluster) {
+        if (inode != NULL)
+            extent_map_append(&inode->map, cur);
 
-        while (is_cluster_inuse(g_fat[0][cur].cluster)) {
-            cur = g_fat[0][cur].cluster;
-        }
-        g_fat[0][cur].cluster = new_cluster;
+        new_tail = cur;
+    }
+
+    if (tail != CLUSTER_END) {
+        set_fat(tail, new_cluster);
     } else {  // 从未分配
         file->first_cluster = new_cluster;
+        image_mark_dirty(file, sizeof(struct FCB));
+    }
+
+    if (inode != NULL) {
+        inode->tail = new_tail;
+        inode->clusters = old_count + count;
     }
 
     return new_cluster;
@@ -1052,33 +2426,65 @@ uint16_t file_new_cluster(struct FCB *file, uint32_t count)
 
 void remove_file(struct FCB *file)
 {
-    release_cluster(file->first_cluster);
+    // 仍被打开的文件，等最后一次关闭时再释放
+    if (!inode_detach(file))
+        release_cluster(file->first_cluster);
 
     file->filename[0] = FILE_DELETE;
+    image_mark_dirty(file, sizeof(struct FCB));
 }
 
 void release_cluster(uint32_t first_num)
 {
     uint32_t next;
-    if (is_cluster_inuse(first_num)) {
-        next = g_fat[0][first_num].cluster;
-        release_cluster(next);
 
-        g_fat[0][first_num].cluster = CLUSTER_FREE;
+    alloc_lock();
+
+    while (is_cluster_inuse(first_num)) {
+        uint32_t run_start = first_num;
+        uint32_t run_len = 0;
+
+        // 先改 FAT 表再归还，簇被其他线程分配到之后不会再被这里改动
+        do {
+            next = g_fat[0][first_num].cluster;
+            set_fat(first_num, CLUSTER_FREE);
+            run_len++;
+            first_num = next;
+        } while (first_num == run_start + run_len && is_cluster_inuse(first_num));
+
+        // 连续的一段簇一起打洞，镜像文件里簇之间不按页对齐的部分也能释放
+        image_discard(cluster_address(run_start), (size_t) run_len * CLUSTER_SIZE);
+
+        for (uint32_t i = 0; i < run_len; i++)
+            alloc_free(run_start + i);
     }
+
+    alloc_unlock();
 }
 
-uint32_t get_cluster_count(const struct FCB *file)
+void discard_free_clusters(void)
 {
-    uint32_t count = 0;
-    uint16_t cur = file->first_cluster;
+    uint32_t run_start = 0;
+    uint32_t run_len = 0;
+
+    // 连续的空闲簇在内存里也连续，一起标记
+    for (uint32_t i = CLUSTER_MIN; i <= g_geo.cluster_end; i++) {
+        if (i < g_geo.cluster_end && g_fat[0][i].cluster == CLUSTER_FREE) {
+            if (run_len++ == 0)
+                run_start = i;
+            continue;
+        }
 
-    while (is_cluster_inuse(cur)) {
-        count++;
-        cur = g_fat[0][cur].cluster;
+        if (run_len > 0)
+            image_discard(cluster_address(run_start), (size_t) run_len * CLUSTER_SIZE);
+        run_len = 0;
     }
+}
 
-    return count;
+uint32_t get_cluster_count(const struct FCB *file)
+{
+    uint16_t tail;
+    return chain_end(file, inode_find(file), &tail);
 }
 
 int my_access(const char *path, int flags)
@@ -1110,14 +2516,25 @@ int adjust_cluster_count(struct FCB *file, uint32_t new_count)
 
         if (pre == CLUSTER_END) { // new_count = 0
             file->first_cluster = CLUSTER_END;
+            image_mark_dirty(file, sizeof(struct FCB));
         } else {
-            g_fat[0][pre].cluster = CLUSTER_END;
+            set_fat(pre, CLUSTER_END);
         }
 
         release_cluster(cur);
+
+        // 打开的文件句柄里缓存的游标可能指向了被释放的簇
+        struct Inode *inode = inode_find(file);
+        if (inode != NULL) {
+            inode->gen++;
+            inode->tail = pre;
+            inode->clusters = new_count;
+            extent_map_truncate(&inode->map, new_count);
+        }
     } else { // 扩容
-        if (CLUSTER_END == file_new_cluster(file, new_count - old_count))
-            return -ENOSPC;
+        int ret = file_new_cluster(file, new_count - old_count, 0, 0);
+        if (ret < 0)
+            return ret;
     }
 
     return 0;
@@ -1132,9 +2549,6 @@ int _truncate(struct FCB *file, off_t offset)
     if (file->metadata & META_DIRECTORY)
         return -EISDIR;
 
-    // 文件大小所需的簇的数量
-//    uint32_t old_cluster_count = (file->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
-
     // 截断后所需的簇的数量
     uint32_t new_cluster_count = (offset + CLUSTER_SIZE - 1) / CLUSTER_SIZE;
 
@@ -1142,30 +2556,82 @@ int _truncate(struct FCB *file, off_t offset)
     uint32_t new_size = offset;
 
     int ret;
+
+    // 文件大小增加：原有的簇里超出文件大小的部分就地清零，新分配的簇在分配时清零，不经过缓冲区
+    if (new_size > old_size && 0 != (ret = zero_gap(file, new_size)))
+        return ret;
+
+    // 增大时保留 fallocate 预留在文件大小之后的簇
+    uint32_t now_cluster_count = get_cluster_count(file);
+    if (new_size >= old_size && new_cluster_count < now_cluster_count)
+        new_cluster_count = now_cluster_count;
+
     if (0 != (ret = adjust_cluster_count(file, new_cluster_count))) {
         return ret;
     }
 
-    if (old_size == new_size) {
+    if (old_size == new_size)
         return 0;
-    } else if (old_size < new_size) { // 文件大小增加
-        // 把后面的内容覆盖为 0
-        void *null_buf = malloc(new_size - old_size);
-        if (null_buf == NULL)
-            return -EFAULT;
-
-        memset(null_buf, 0, new_size - old_size);
-        long long n;
-        if (new_size - old_size != (n = write_file(file, null_buf, old_size, new_size - old_size))) {
-            free(null_buf);
-            return (int) n;
-        }
-        free(null_buf);
-    } else { // 文件大小减少
-        // 不用管
-    }
 
     file->size = new_size;
+    image_mark_dirty(file, sizeof(struct FCB));
     return 0;
 }
 
+int _fallocate(struct FCB *file, int mode, off_t offset, off_t length, struct FileHandle *fh)
+{
+    if (offset < 0 || length <= 0)
+        return -EINVAL;
+
+    if (mode != 0 && mode != FALLOC_FL_KEEP_SIZE && mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE))
+        return -EOPNOTSUPP;
+
+    if (file->metadata & META_DIRECTORY)
+        return -EISDIR;
+
+    uint64_t end = (uint64_t) offset + (uint64_t) length;
+    uint32_t now_cluster_count = get_cluster_count(file);
+    int ret;
+
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        // 文件大小之后、并且一直到簇链末尾都在范围内的簇可以直接释放
+        uint64_t keep = file->size > (uint64_t) offset ? file->size : (uint64_t) offset;
+        uint32_t keep_count = (uint32_t) ((keep + CLUSTER_SIZE - 1) / CLUSTER_SIZE);
+        if (end < (uint64_t) now_cluster_count * CLUSTER_SIZE || keep_count > now_cluster_count)
+            keep_count = now_cluster_count;
+
+        // 其余部分就地清零，整页的部分换成零页（mmap 模式下在镜像文件里打洞）
+        uint64_t zero_end = (uint64_t) keep_count * CLUSTER_SIZE;
+        if (end < zero_end)
+            zero_end = end;
+
+        if ((uint64_t) offset < zero_end &&
+            0 != (ret = for_each_run(file, (uint32_t) offset, (uint32_t) (zero_end - offset), fh, zero_in, NULL, 1)))
+            return ret;
+
+        if (keep_count < now_cluster_count)
+            return adjust_cluster_count(file, keep_count);
+
+        return 0;
+    }
+
+    if (end > UINT32_MAX)
+        return -EFBIG;
+
+    // 增大文件时原有的簇里超出文件大小的部分要读到 0
+    int grow = !(mode & FALLOC_FL_KEEP_SIZE) && end > file->size;
+    if (grow && 0 != (ret = zero_gap(file, (uint32_t) end)))
+        return ret;
+
+    // 缺少的簇一次分配，分配器优先给出紧接着文件末尾的或者第一个足够长的连续区间
+    uint32_t new_cluster_count = (uint32_t) ((end + CLUSTER_SIZE - 1) / CLUSTER_SIZE);
+    if (new_cluster_count > now_cluster_count && 0 != (ret = adjust_cluster_count(file, new_cluster_count)))
+        return ret;
+
+    if (grow) {
+        file->size = (uint32_t) end;
+        image_mark_dirty(file, sizeof(struct FCB));
+    }
+
+    return 0;
+}
@@ -24,29 +24,42 @@
 #define META_DIRECTORY      0b00010000
 #define META_ARCHIVE        0b00100000
 
-#define BYTES_PER_SECTOR        512
-#define NUMBER_OF_FAT           2
-#define SECTORS_PER_CLUSTER     32
-#define RESERVED_SECTOR         1
-#define ROOT_ENTRIES            512
-#define SECTORS_PER_FAT         9
-
-// 一个簇的大小
-#define CLUSTER_SIZE (BYTES_PER_SECTOR * SECTORS_PER_CLUSTER)
-
-#define GET_
-
-// 根目录扇区数
-#define ROOT_SECTORS    ((ROOT_ENTRIES * sizeof(struct FCB) + BYTES_PER_SECTOR - 1) / BYTES_PER_SECTOR)
+// 格式化时的默认参数，挂载已有的镜像时以 BPB 为准
+#define DEFAULT_BYTES_PER_SECTOR    512
+#define DEFAULT_CLUSTER_SIZE        16384
+#define DEFAULT_RESERVED_SECTOR     1
+#define DEFAULT_NUMBER_OF_FAT       2
+#define DEFAULT_ROOT_ENTRIES        512
+#define DEFAULT_DATA_CLUSTERS       0x100
+
+// 最多支持的 FAT 表数量
+#define MAX_FATS 2
+
+// FAT16 最多的簇数量
+#define MAX_CLUSTERS 65524
+
+// 卷的几何参数，格式化时由选项决定，挂载时从 BPB 读出
+struct Geometry {
+    uint32_t bytes_per_sector;          // 扇区字节数
+    uint32_t sectors_per_cluster;       // 每簇扇区数
+    uint32_t cluster_size;              // 一个簇的大小
+    uint32_t reserved_sectors;          // 第一个 FAT 之前的扇区数
+    uint32_t number_of_fat;             // FAT 表数量
+    uint32_t sectors_per_fat;           // 每个 FAT 占用的扇区数
+    uint32_t root_entries;              // 根目录项数
+    uint32_t root_sectors;              // 根目录扇区数
+    uint32_t header_sectors;            // 除了数据区外，占用的扇区数
+    uint32_t total_sectors;             // 卷的总扇区数
+    uint32_t cluster_end;               // 最大可用簇号 + 1，同时受数据区和 FAT 表大小限制
+};
 
-// 数据区扇区数
-#define DATA_SECTORS  (0x100 * SECTORS_PER_CLUSTER)
+extern struct Geometry g_geo;
 
-// 除了数据区外，占用的扇区数
-#define HEADER_SECTORS (ROOT_SECTORS + NUMBER_OF_FAT * SECTORS_PER_FAT + RESERVED_SECTOR)
+// 一个簇的大小
+#define CLUSTER_SIZE (g_geo.cluster_size)
 
-// 虚拟磁盘空间大小
-#define DRIVE_SIZE ((HEADER_SECTORS + DATA_SECTORS) * BYTES_PER_SECTOR)
+// 根目录项数
+#define ROOT_ENTRIES (g_geo.root_entries)
 
 // 文件删除标记
 #define FILE_DELETE '\xe5'
@@ -54,6 +67,16 @@
 struct options {
     const char *filename;
     int is_create;
+    int use_mmap;
+    unsigned int cache_mb;              // 按需载入的内存预算（MiB），为 0 则整个镜像读入内存
+    const char *io_engine;              // 读写镜像文件的引擎，"sync" 或 "uring"，为 NULL 则同步读写
+    unsigned int io_threads;            // 后台读入镜像和并行读写的线程数，为 0 则按 CPU 数决定
+    unsigned int checkpoint_ms;         // 后台检查点的周期（毫秒），为 0 则只在卸载和 fsync 时写回
+    int journal;                        // 元数据先写到镜像旁边的日志文件（镜像路径加 .journal），挂载时重放
+    const char *snapshot;               // 收到 SIGUSR1 时把整个卷写到这个文件，为 NULL 则不处理
+    unsigned int size_mb;               // 格式化：卷大小（MiB），为 0 则数据区为 DEFAULT_DATA_CLUSTERS 个簇
+    unsigned int cluster_size;          // 格式化：簇大小（字节），为 0 则用默认值
+    unsigned int root_entries;          // 格式化：根目录项数，为 0 则用默认值
     int show_help;
 };
 
@@ -81,7 +104,7 @@ struct EBPB {
     uint8_t physical_drive_number;      // 物理驱动器号
     uint8_t reserved;                   // 保留，一般为 1
     uint8_t extended_boot_signature;    // 扩展引导标签
-    uint16_t volume_serial_number;      // 卷序号
+    uint32_t volume_serial_number;      // 卷序号
     char volume_label[11];           // 卷标
     char file_system_type[8];        // 文件系统类型，"FAT16"
 }__attribute__((packed));
@@ -92,9 +115,12 @@ struct BootRecord {
     struct BPB bpb;
     struct EBPB ebpb;
     uint8_t boot_code[448];             // 引导程序代码
-    uint32_t end_signature;             // 扇区结束标志 0xaa55
+    uint16_t end_signature;             // 扇区结束标志 0xaa55
 }__attribute__((packed));
 
+// 引导扇区的结束标志，位于扇区的第 510、511 字节
+#define BOOT_SIGNATURE 0xaa55
+
 // 未分配的簇
 #define CLUSTER_FREE    0x0000
 
@@ -127,13 +153,36 @@ struct FAT {
     uint16_t cluster;                   // 簇号
 };
 
+struct FileHandle;
+struct DirIndex;
+
+/**
+ * 根据格式化选项计算卷的几何参数
+ * @param size 卷大小（字节），为 0 则数据区为 DEFAULT_DATA_CLUSTERS 个簇
+ * @param cluster_size 簇大小，512 的 2 的幂倍，最大 64 KiB
+ * @param root_entries 根目录项数
+ * @param geo 保存几何参数
+ * @return 成功返回 0，参数不合法或簇数量超出 FAT16 的范围返回 -1
+ */
+int geometry_for_format(uint64_t size, uint32_t cluster_size, uint32_t root_entries, struct Geometry *geo);
+
+/**
+ * 校验引导扇区并读出卷的几何参数，只依赖引导扇区本身，不访问 FAT 和数据区
+ * 结束标志、扇区和簇大小、FAT 数量、根目录大小、FAT 表能否覆盖数据区都会被检查
+ * @param boot_record 镜像的第一个扇区
+ * @param size 镜像文件的大小，卷不能超出文件
+ * @param geo 保存几何参数
+ * @return 成功返回 0，不是合法的 FAT16 卷返回 -1
+ */
+int geometry_from_boot_record(const struct BootRecord *boot_record, uint64_t size, struct Geometry *geo);
+
 /**
  * 将一块内存区域格式化为 fat16 文件系统
- * @param addr 内存起始地址
- * @param size 内存区域大小
+ * @param addr 内存起始地址，大小至少为 geo->total_sectors 个扇区
+ * @param geo 卷的几何参数
  * @return 成功返回 0，反之返回 -1
  */
-int fat16_format(char *addr, int size);
+int fat16_format(char *addr, const struct Geometry *geo);
 
 /**
  * 读取文件/目录的内容
@@ -141,9 +190,10 @@ int fat16_format(char *addr, int size);
  * @param buff 保存读入数据的缓冲区
  * @param offset 读取的起点
  * @param length 读入数据的长度
+ * @param fh 文件句柄，可为 NULL；不为 NULL 时利用句柄缓存的游标定位簇
  * @return 返回读入的数据长度,出错返回负值
  */
-long long read_file(const struct FCB *fcb, void *buff, uint32_t offset, uint32_t length);
+long long read_file(const struct FCB *fcb, void *buff, uint32_t offset, uint32_t length, struct FileHandle *fh);
 
 /**
  * 往文件写入数据
@@ -151,19 +201,139 @@ long long read_file(const struct FCB *fcb, void *buff, uint32_t offset, uint32_t
  * @param buff 待写入的数据
  * @param offset 写入数据的起始点
  * @param length 写入数据的长度
+ * @param fh 文件句柄，可为 NULL；不为 NULL 时利用句柄缓存的游标定位簇
  * @return 返回写入的数据长度,出错返回负值
  */
-long long write_file(struct FCB *fcb, const void *buff, uint32_t offset, uint32_t length);
+long long write_file(struct FCB *fcb, const void *buff, uint32_t offset, uint32_t length, struct FileHandle *fh);
+
+/**
+ * 计算从 offset 开始最多能读多少字节
+ * @param fcb 文件的 FCB 结构体指针
+ * @param offset 读取的起点
+ * @param length 希望读取的长度
+ * @return 不超过文件末尾的长度，offset 超出文件大小时返回 0
+ */
+uint32_t clamp_read(const struct FCB *fcb, uint32_t offset, uint32_t length);
+
+/**
+ * 写入前的准备：保证 [offset, offset + length) 都已分配了簇，并更新文件大小
+ * 调用者随后要写满这个范围，完全被覆盖的新簇不清零；写入失败时用 cancel_reserve 撤销
+ * @param fcb 文件的 FCB 结构体指针
+ * @param offset 写入数据的起始点
+ * @param length 写入数据的长度
+ * @return 成功返回 0，没有空间返回 -ENOSPC，范围溢出返回 -EINVAL
+ */
+int reserve_file(struct FCB *fcb, uint32_t offset, uint32_t length);
+
+/**
+ * 写入失败时撤销 reserve_file：恢复文件大小并释放新增的簇，没写满的新簇里还是之前的文件留下的内容
+ * @param fcb 文件的 FCB 结构体指针
+ * @param size reserve_file 之前的文件大小
+ * @param clusters reserve_file 之前的簇数量
+ */
+void cancel_reserve(struct FCB *fcb, uint32_t size, uint32_t clusters);
+
+/**
+ * 访问文件中一段物理上连续的数据
+ * @param addr 数据在内存中的起始地址
+ * @param length 数据长度
+ * @param pos 这段数据距离访问起点的偏移
+ * @param arg for_each_run 传入的参数
+ * @return 返回 0 继续访问下一段，非 0 则停止
+ */
+typedef int (*run_visitor)(char *addr, uint32_t length, uint32_t pos, void *arg);
+
+/**
+ * 按物理上连续的簇把文件的 [offset, offset + length) 拆成若干段，依次访问，并更新句柄的游标
+ * 调用者保证这个范围内的簇都已分配
+ * @param fcb 文件的 FCB 结构体指针
+ * @param offset 起点
+ * @param length 长度
+ * @param fh 文件句柄，可为 NULL
+ * @param visit 访问函数
+ * @param arg 传给访问函数的参数
+ * @param overwrite 为 1 表示访问函数会覆盖整段数据，按需载入时不必先读出旧的内容
+ * @return 全部访问完返回 0，读入失败返回 -errno，反之返回 visit 的返回值
+ */
+int for_each_run(const struct FCB *fcb, uint32_t offset, uint32_t length, struct FileHandle *fh,
+                 run_visitor visit, void *arg, int overwrite);
+
+/**
+ * 定位文件内的第 index 个簇
+ * @param fcb 文件的 FCB 结构体指针
+ * @param index 文件内的簇序号
+ * @param fh 文件句柄，可为 NULL；游标有效且不在目标之后时从游标开始查找
+ * @return 返回簇号
+ */
+uint16_t seek_cluster(const struct FCB *fcb, uint32_t index, struct FileHandle *fh);
+
+/**
+ * 更新文件句柄的游标
+ * @param fh 文件句柄，为 NULL 时什么都不做
+ * @param index 文件内的簇序号
+ * @param cluster_num 对应的簇号
+ */
+void update_cursor(struct FileHandle *fh, uint32_t index, uint16_t cluster_num);
+
+/**
+ * 把文件名转换成目录项中的格式：截取前 8 个字符，不足的用空格补齐
+ * @param name 文件名（不含路径）
+ * @param key 保存转换结果，长度为 MAX_FILENAME，不以 \0 结束
+ */
+void make_name_key(const char *name, char *key);
 
 /**
- * 查找文件或目录，需要注意的是，若路径是根目录需另行处理，该函数会返回 NULL
- * @param root 查找起始目录
- * @param entries 目录的项数
- * @param path 文件路径
- * @param error_code 错误码，为 0 表示找到文件了（返回值必定不为NULL），找不到文件置为 -ENOENT，路径中间有非目录则置为 -ENOTDIR
+ * 在一段连续的目录项中查找文件，直接比较目录项里用空格补齐的文件名，不分配内存
+ * @param dir 目录项数组
+ * @param entries 目录项数量
+ * @param key make_name_key 转换后的文件名
+ * @param end 遇到终止项时置为 1，后面不用再找了
  * @return 返回 FCB 控制块，找不到文件则返回 NULL
  */
-struct FCB *find_file(struct FCB *root, uint32_t entries, const char *path, int *error_code);
+struct FCB *find_entry(struct FCB *dir, uint32_t entries, const char *key, int *end);
+
+/**
+ * 在目录中查找文件，调用者持有目录锁
+ * @param dir_file 目录在父目录中的目录项，为 NULL 表示根目录
+ * @param name 文件名（不含路径）
+ * @param error_code 保存错误码，找不到文件时为 0，读取目录失败为 -EIO
+ * @return 返回 FCB 控制块，找不到文件或出错则返回 NULL
+ */
+struct FCB *find_in_dir(const struct FCB *dir_file, const char *name, int *error_code);
+
+/**
+ * 查找路径对应的文件或目录，先查路径缓存，未命中时逐级解析父目录（父目录同样经过缓存），结果写回缓存
+ * 返回时不持有任何锁，之后要读写目录项的话改用 lock_parent 和 lookup_child
+ * @param path 完整路径，以 '/' 开头
+ * @param error_code 错误码，为 0 表示找到文件了（返回值必定不为NULL），找不到文件置为 -ENOENT，路径中间有非目录则置为 -ENOTDIR，读取目录失败置为 -EIO
+ * @return 返回 FCB 控制块，找不到文件或路径是根目录则返回 NULL
+ */
+struct FCB *lookup_path(const char *path, int *error_code);
+
+/**
+ * 查找路径的父目录
+ * @param path 完整路径，以 '/' 开头
+ * @param dir_file 保存父目录的目录项，父目录是根目录时为 NULL
+ * @return 成功返回 0，反之返回错误码，父目录不是目录时返回 -ENOTDIR
+ */
+int lookup_parent(const char *path, struct FCB **dir_file);
+
+/**
+ * 查找并锁住路径的父目录
+ * @param path 完整路径，以 '/' 开头
+ * @param dir_file 保存父目录的目录项，父目录是根目录时为 NULL
+ * @param index 保存父目录的索引，成功时已加锁，用 dir_index_unlock 解锁
+ * @return 成功返回 0，反之返回错误码
+ */
+int lock_parent(const char *path, struct FCB **dir_file, struct DirIndex **index);
+
+/**
+ * 在已锁住的父目录中查找路径对应的文件，先查路径缓存，结果写回缓存
+ * @param index 父目录的索引，调用者持有它的锁
+ * @param path 完整路径
+ * @return 返回 FCB 控制块，找不到则返回 NULL
+ */
+struct FCB *lookup_child(struct DirIndex *index, const char *path);
 
 /**
  * 获取文件的名称
@@ -173,7 +343,8 @@ struct FCB *find_file(struct FCB *root, uint32_t entries, const char *path, int
 char *get_filename(const struct FCB *file);
 
 /**
- * 根据簇号，获取指向该簇的内存指针
+ * 根据簇号，获取指向该簇的内存指针，用于目录：按需载入时簇会被读入并一直常驻，返回的指针可以长期引用
+ * 文件数据通过 for_each_run 访问，只在访问期间钉住
  * @param cluster_num 簇号
  * @return 返回簇的起始地址，失败则返回 NULL
  */
@@ -186,6 +357,20 @@ char *get_cluster(uint32_t cluster_num);
  */
 int is_cluster_inuse(uint32_t cluster_num);
 
+/**
+ * 读取 FAT 表项
+ * @param cluster_num 簇号
+ * @return 下一个簇号，或 CLUSTER_FREE/CLUSTER_END
+ */
+uint16_t get_fat(uint32_t cluster_num);
+
+/**
+ * 修改 FAT 表项，同时标记为需要写回
+ * @param cluster_num 簇号
+ * @param value 新的表项值（下一个簇号或 CLUSTER_FREE/CLUSTER_END）
+ */
+void set_fat(uint32_t cluster_num, uint16_t value);
+
 /**
  * 判断该目录项是否是终止项
  * @param fcb 目录项的 FCB 结构体指针
@@ -215,26 +400,56 @@ int is_filename_available(const char *filename);
  */
 struct FCB *get_free_entry(struct FCB *dir, uint32_t entries);
 
+/**
+ * 在目录中取出一个可用的目录项，目录满了则扩容，调用者持有目录锁
+ * 写入文件名后需要调用 dir_index_insert 加入索引
+ * @param dir_file 目录在父目录中的目录项，为 NULL 表示根目录
+ * @param index 目录的索引
+ * @param error_code 保存错误码：目录项满了或内存不足为 -ENFILE，扩容时没有空间为 -ENOSPC，读取失败为 -EIO
+ * @return 成功返回目录项的 FCB 指针，失败返回 NULL
+ */
+struct FCB *alloc_entry(struct FCB *dir_file, struct DirIndex *index, int *error_code);
+
+/**
+ * 获取根目录
+ * @return 返回根目录第一个目录项的指针，共 ROOT_ENTRIES 项
+ */
+struct FCB *get_root_dir(void);
+
 /**
  * 获取可用的簇，返回起始的簇号
+ * 尽量分配连续的簇，簇链按簇号从小到大链接，最后一个簇的表项为 CLUSTER_END
  * @param count 分配多少个簇
+ * @param hint 希望的起始簇号，通常是文件最后一个簇的下一个簇，CLUSTER_END 表示不指定
  * @return 若为 CLUSTER_END 表示已无可用的簇号，反之返回起始的簇号
  */
-uint16_t get_free_cluster_num(uint32_t count);
+uint16_t get_free_cluster_num(uint32_t count, uint16_t hint);
+
+/**
+ * 获取从某个簇开始，在簇链上同时也是物理上连续的簇
+ * @param cluster_num 起始簇号
+ * @param max_count 最多需要多少个簇
+ * @param last 保存这段连续簇的最后一个簇号
+ * @return 连续簇的数量，至少为 1
+ */
+uint32_t get_contiguous_clusters(uint16_t cluster_num, uint32_t max_count, uint16_t *last);
 
 /**
  * 判断目录是否为空
  * @param dir 目录文件在父目录上的目录项(FCB) 指针
- * @return 是返回 1，反之返回 0
+ * @return 是返回 1，反之返回 0，读取目录失败返回 -EIO
  */
 int is_directory_empty(const struct FCB *file);
 
 /**
- * 给文件新增一个簇
+ * 给文件新增簇，链接到簇链末尾并清零
  * @param file 文件对应的 FCB 指针
- * @return 返回第一个簇的簇号，失败则返回 CLUSTER_END
+ * @param count 新增的簇数
+ * @param offset 调用者接下来会写满的范围的起点，完全落在范围内的新簇不清零
+ * @param length 会写满的范围的长度，为 0 则所有新簇都清零
+ * @return 返回第一个簇的簇号，没有空间返回 -ENOSPC，按需载入时读取失败返回 -EIO，失败时文件不变
  */
-uint16_t file_new_cluster(struct FCB *file, uint32_t count);
+int file_new_cluster(struct FCB *file, uint32_t count, uint32_t offset, uint32_t length);
 
 
 /**
@@ -250,7 +465,12 @@ void remove_file(struct FCB *file);
 void release_cluster(uint32_t first_num);
 
 /**
- * 获取文件占用的簇的数量
+ * 挂载时把 FAT 中所有空闲的簇标记为不再使用，之后回写时在镜像文件里打洞
+ */
+void discard_free_clusters(void);
+
+/**
+ * 获取文件占用的簇的数量，打开的文件只在第一次调用时沿着簇链数，之后直接取 inode 里缓存的值
  * @param file 文件对应的 FCB 指针
  * @return 返回文件占用的簇的数量
  */
@@ -272,6 +492,19 @@ int adjust_cluster_count(struct FCB *file, uint32_t new_count);
  */
 int _truncate(struct FCB *file, off_t offset);
 
+/**
+ * 为文件预留或释放空间
+ * 预留时一次分配所有缺少的簇，分配器优先给出连续的一段；不带 FALLOC_FL_KEEP_SIZE 时同时增大文件
+ * FALLOC_FL_PUNCH_HOLE 把范围内的内容清零，FAT 的簇链不能有空洞，只有超出文件大小的整簇会被释放
+ * @param file 文件对应的 FCB 指针
+ * @param mode 0、FALLOC_FL_KEEP_SIZE 或 FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE
+ * @param offset 范围的起点
+ * @param length 范围的长度
+ * @param fh 文件句柄，可为 NULL
+ * @return 0 表示成功，不支持的 mode 返回 -EOPNOTSUPP，其余为错误码
+ */
+int _fallocate(struct FCB *file, int mode, off_t offset, off_t length, struct FileHandle *fh);
+
 // fuse {
 
 void *my_init(struct fuse_conn_info *, struct fuse_config *);
@@ -290,12 +523,23 @@ int my_read(const char *, char *, size_t, off_t, struct fuse_file_info *);
 
 int my_write(const char *, const char *, size_t, off_t, struct fuse_file_info *);
 
+int my_read_buf(const char *, struct fuse_bufvec **, size_t, off_t, struct fuse_file_info *);
+
+int my_write_buf(const char *, struct fuse_bufvec *, off_t, struct fuse_file_info *);
+
 int my_flush(const char *, struct fuse_file_info *);
 
 int my_release(const char *, struct fuse_file_info *);
 
+int my_fsync(const char *, int, struct fuse_file_info *);
+
 int my_truncate(const char *, off_t, struct fuse_file_info *);
 
+int my_fallocate(const char *, int, off_t, off_t, struct fuse_file_info *);
+
+ssize_t my_copy_file_range(const char *, struct fuse_file_info *, off_t, const char *, struct fuse_file_info *, off_t,
+                           size_t, int);
+
 int my_rename(const char *, const char *, unsigned int);
 
 int my_chmod(const char *, mode_t, struct fuse_file_info *);
@@ -0,0 +1,1378 @@
+//
+// 虚拟磁盘镜像的加载与保存
+//
+
+#define _GNU_SOURCE     // fallocate
+
+#include "my_image.h"
+#include "my_io.h"
+#include "my_journal.h"
+
+#include <fuse3/fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+
+// 脏标记的粒度，和扇区大小一致
+#define DIRTY_BLOCK_SIZE 512
+
+// 一个字能记录的块数
+#define BITS_PER_WORD 64
+
+// 整个读入镜像时每个读请求的大小，多个请求一起提交
+#define LOAD_CHUNK_SIZE (1 << 20)
+
+// 回写时最多攒多少个写请求一起提交
+#define FLUSH_BATCH 64
+
+// 写快照时每次写入的大小
+#define SNAPSHOT_CHUNK (1 << 20)
+
+// 日志超过这个大小时，等镜像落盘后清空
+#define JOURNAL_RESET_SIZE (16 << 20)
+
+static char *g_image;       // 镜像在内存中的起始地址
+static size_t g_image_size; // 镜像大小
+static int g_image_fd = -1; // 镜像文件
+static int g_image_mmap;    // 是否是 mmap 映射的
+
+static uint64_t *g_dirty;   // 脏块位图，每一位对应一个 DIRTY_BLOCK_SIZE 大小的块
+static uint64_t *g_meta;    // 脏块中哪些是元数据（FAT 和目录），检查点时在切点复制一份
+static uint64_t *g_cp_dirty;// 检查点取走的脏标记
+static uint64_t *g_cp_meta; // 检查点取走的元数据标记
+static uint64_t *g_journaled;// 日志清空以来写进过日志的块，由 g_flush_lock 保护
+static uint64_t *g_discard; // 被释放的块，回写时在镜像文件里打洞
+static uint64_t *g_cp_discard;// 检查点取走的释放标记
+static int g_punch_unsupported;     // 文件系统不支持打洞，不再尝试
+static char *g_cp_copy;     // 检查点在切点复制的元数据，按位图顺序排列
+static size_t g_dirty_words;// 位图的字数
+static pthread_mutex_t g_flush_lock = PTHREAD_MUTEX_INITIALIZER;   // 同一时间只有一个线程在回写
+
+// 按需载入时快照的子进程从镜像文件读没在内存里的块，它结束之前回写都要等待
+static pid_t g_snapshot_pid;        // 正在写快照的子进程，由 g_flush_lock 保护
+static pthread_cond_t g_snapshot_done = PTHREAD_COND_INITIALIZER;
+
+// 按需载入时块的状态
+#define BLOCK_RESIDENT      0x01    // 已经读入内存
+#define BLOCK_REFERENCED    0x02    // 最近被访问过，CLOCK 扫到时先清除这一位，下一轮再淘汰
+#define BLOCK_STICKY        0x04    // 一直常驻，不会被淘汰
+#define BLOCK_LOADING       0x08    // 正在被某个线程从文件读入，其他线程等它完成
+
+static size_t g_cache_budget;       // 内存预算，为 0 则不按需载入
+static size_t g_cache_pinned;       // 镜像开头常驻内存的部分
+static size_t g_cache_block;        // 块大小，页大小的整数倍
+static size_t g_cache_blocks;       // 常驻部分之后的块数，为 0 表示没有启用
+static size_t g_cache_limit;        // 最多在内存里的块数，所有块都被钉住时允许暂时超出
+static size_t g_cache_hand;         // CLOCK 的指针
+static uint8_t *g_block_state;      // 每个块的状态
+static uint32_t *g_block_pins;      // 每个块被 image_acquire 钉住的次数
+static char *g_mapping;             // 保留的整个镜像大小的匿名映射，没读入的块不占用内存
+static size_t g_mapping_size;
+static struct ImageCacheStats g_cache_stats;
+static pthread_mutex_t g_cache_lock = PTHREAD_MUTEX_INITIALIZER;  // 保护块的状态，在 g_flush_lock 之前获取
+static pthread_cond_t g_cache_loaded = PTHREAD_COND_INITIALIZER;  // 有块读入完成
+
+// 后台读入借用按需载入的块状态，只是所有块都可以常驻，不会被淘汰
+static unsigned g_prefetch_threads;     // 后台读入的线程数，为 0 则打开时读入整个镜像
+static pthread_t *g_prefetchers;
+static unsigned g_prefetcher_count;
+static size_t g_prefetch_next;          // 下一个要读入的块，各线程原子地领取
+static unsigned g_prefetch_running;     // 还没结束的后台线程数
+static int g_prefetch_stop;             // 卸载时要求后台线程停止
+static int g_prefetch_failed;           // 有块读取失败，留到访问时再读
+static struct timespec g_prefetch_start;
+static int g_cache_complete;            // 所有块都已读入且不会被淘汰，访问时不再检查块的状态
+
+static int write_range(size_t start, size_t end, int sync);
+static void prefetch_start(void);
+
+int image_peek(const char *filename, void *buf, size_t len, off_t *size)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    ssize_t n = -1;
+    if (fstat(fd, &st) == 0) {
+        *size = st.st_size;
+        n = pread(fd, buf, len, 0);
+    }
+    close(fd);
+
+    return n == (ssize_t) len ? 0 : -1;
+}
+
+void image_set_cache(size_t budget, size_t pinned, size_t block_size)
+{
+    g_cache_budget = budget;
+    g_cache_pinned = pinned;
+    g_cache_block = block_size;
+}
+
+void image_set_prefetch(size_t pinned, size_t block_size, unsigned threads)
+{
+    g_prefetch_threads = threads;
+    g_cache_pinned = pinned;
+    g_cache_block = block_size;
+}
+
+/**
+ * 按需载入模式下打开镜像：保留整个镜像大小的地址空间，只读入开头常驻的部分
+ * 每个块在地址空间里的位置固定，和整个读入时一样，物理上连续的簇在内存里也连续
+ */
+static char *cache_open(int fd, size_t size)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t block = (g_cache_block + page - 1) / page * page;
+    size_t pinned = g_cache_pinned < size ? g_cache_pinned : size;
+
+    // 第一个块按页对齐，淘汰时才能单独释放它占用的页
+    size_t pad = (page - pinned % page) % page;
+    size_t blocks = (size - pinned + block - 1) / block;
+    size_t mapping_size = pad + pinned + blocks * block;
+
+    char *mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                         -1, 0);
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    g_block_state = calloc(blocks + 1, sizeof(uint8_t));
+    g_block_pins = calloc(blocks + 1, sizeof(uint32_t));
+    struct IoRequest req = {mapping + pad, pinned, 0, 0};
+    if (g_block_state == NULL || g_block_pins == NULL || io_run(fd, &req, 1) != 0) {
+        free(g_block_state);
+        free(g_block_pins);
+        g_block_state = NULL;
+        g_block_pins = NULL;
+        munmap(mapping, mapping_size);
+        return NULL;
+    }
+
+    g_mapping = mapping;
+    g_mapping_size = mapping_size;
+    g_cache_pinned = pinned;
+    g_cache_block = block;
+    g_cache_blocks = blocks;
+    g_cache_limit = g_cache_budget / block > 0 ? g_cache_budget / block : 1;
+    if (g_cache_budget == 0)
+        g_cache_limit = blocks;
+    g_cache_hand = 0;
+    memset(&g_cache_stats, 0, sizeof(g_cache_stats));
+    g_cache_stats.limit = g_cache_limit;
+    g_cache_stats.block_size = block;
+
+    return mapping + pad;
+}
+
+/**
+ * 整个读入镜像，拆成多个请求一起提交
+ * @return 成功返回 0，失败返回 -errno
+ */
+static int load_all(int fd, char *addr, size_t size)
+{
+    size_t count = (size + LOAD_CHUNK_SIZE - 1) / LOAD_CHUNK_SIZE;
+    struct IoRequest *reqs = malloc(count * sizeof(struct IoRequest));
+    if (reqs == NULL)
+        return -ENOMEM;
+
+    for (size_t i = 0; i < count; i++) {
+        size_t pos = i * LOAD_CHUNK_SIZE;
+        reqs[i].buf = addr + pos;
+        reqs[i].len = size - pos < LOAD_CHUNK_SIZE ? size - pos : LOAD_CHUNK_SIZE;
+        reqs[i].pos = (off_t) pos;
+        reqs[i].write = 0;
+    }
+
+    int ret = io_run(fd, reqs, count);
+    free(reqs);
+    return ret;
+}
+
+char *image_open(const char *filename, size_t size, int is_create, int use_mmap)
+{
+    int flags = O_RDWR;
+    if (is_create)
+        flags |= O_CREAT | O_TRUNC;
+
+    int fd = open(filename, flags, 0644);
+    if (fd < 0) {
+        fuse_log(FUSE_LOG_ERR, "image: failed to open %s\n", filename);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    // 已有的镜像不够大说明被截断了，不能当作全 0 补齐
+    if (!is_create && (size_t) st.st_size < size) {
+        fuse_log(FUSE_LOG_ERR, "image: %s is smaller than the volume\n", filename);
+        close(fd);
+        return NULL;
+    }
+
+    // 新建的文件补齐到镜像大小，补上的部分读出来都是 0，之后只需回写改动过的部分
+    if ((size_t) st.st_size < size && ftruncate(fd, (off_t) size) != 0) {
+        fuse_log(FUSE_LOG_ERR, "image: failed to resize %s\n", filename);
+        close(fd);
+        return NULL;
+    }
+
+    size_t blocks = (size + DIRTY_BLOCK_SIZE - 1) / DIRTY_BLOCK_SIZE;
+    g_dirty_words = (blocks + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    // 位图一起分配，检查点用的预先分配好，建立切点时不会因为内存不足失败
+    g_dirty = calloc(7 * g_dirty_words, sizeof(uint64_t));
+    if (g_dirty == NULL) {
+        close(fd);
+        return NULL;
+    }
+    g_meta = g_dirty + g_dirty_words;
+    g_cp_dirty = g_meta + g_dirty_words;
+    g_cp_meta = g_cp_dirty + g_dirty_words;
+    g_journaled = g_cp_meta + g_dirty_words;
+    g_discard = g_journaled + g_dirty_words;
+    g_cp_discard = g_discard + g_dirty_words;
+
+    char *addr;
+    if (use_mmap) {
+        addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            fuse_log(FUSE_LOG_ERR, "image: failed to mmap %s\n", filename);
+            addr = NULL;
+        }
+    } else if (g_cache_budget > 0 || (g_prefetch_threads > 0 && !is_create)) {
+        addr = cache_open(fd, size);
+        if (addr == NULL)
+            fuse_log(FUSE_LOG_ERR, "image: failed to set up the cache for %s\n", filename);
+    } else {
+        addr = calloc(1, size);
+        if (addr != NULL && !is_create && load_all(fd, addr, size) != 0) {
+            fuse_log(FUSE_LOG_ERR, "image: failed to read %s\n", filename);
+            free(addr);
+            addr = NULL;
+        }
+    }
+
+    if (addr == NULL) {
+        free(g_dirty);
+        g_dirty = NULL;
+        close(fd);
+        return NULL;
+    }
+
+    g_image = addr;
+    g_image_size = size;
+    g_image_fd = fd;
+    g_image_mmap = use_mmap;
+
+    if (g_cache_blocks > 0 && g_cache_budget == 0)
+        prefetch_start();
+
+    return addr;
+}
+
+/**
+ * 计算一段镜像内存涉及的块
+ * @return 涉及按需载入的块返回 1，反之（没有启用或只涉及常驻部分）返回 0
+ */
+static int cache_range(const void *addr, size_t len, size_t *first, size_t *last)
+{
+    const char *start = addr;
+    const char *end = start + len;
+    const char *base = g_image + g_cache_pinned;
+
+    if (g_cache_blocks == 0 || len == 0 || end <= base || start >= g_image + g_image_size)
+        return 0;
+
+    // 后台读入完成后所有块都在内存里，之前钉住的块不再解除也没关系
+    if (__atomic_load_n(&g_cache_complete, __ATOMIC_ACQUIRE))
+        return 0;
+
+    if (start < base)
+        start = base;
+
+    *first = (size_t) (start - base) / g_cache_block;
+    *last = (size_t) (end - 1 - base) / g_cache_block;
+    return 1;
+}
+
+static char *block_addr(size_t i)
+{
+    return g_image + g_cache_pinned + i * g_cache_block;
+}
+
+// 最后一个块可能不完整
+static size_t block_len(size_t i)
+{
+    size_t pos = g_cache_pinned + i * g_cache_block;
+    return g_image_size - pos < g_cache_block ? g_image_size - pos : g_cache_block;
+}
+
+/**
+ * 检查位图中 [first, first + count) 范围内的标记
+ * @param clear 为 1 则同时清除
+ * @return 其中有被标记的块返回 1，反之返回 0
+ */
+static int scan_bits(uint64_t *bitmap, size_t first, size_t count, int clear)
+{
+    int dirty = 0;
+    size_t end = first + count;
+
+    for (size_t i = first; i < end;) {
+        size_t bit = i % BITS_PER_WORD;
+        size_t n = BITS_PER_WORD - bit < end - i ? BITS_PER_WORD - bit : end - i;
+        uint64_t mask = n == BITS_PER_WORD ? UINT64_MAX : (((uint64_t) 1 << n) - 1) << bit;
+        uint64_t *word = &bitmap[i / BITS_PER_WORD];
+
+        if (__atomic_load_n(word, __ATOMIC_RELAXED) & mask) {
+            if (!clear)
+                return 1;
+            dirty |= (__atomic_fetch_and(word, ~mask, __ATOMIC_ACQ_REL) & mask) != 0;
+        }
+
+        i += n;
+    }
+
+    return dirty;
+}
+
+/**
+ * 淘汰一个块：有改动则先写回，再释放它占用的内存，之后再读取得到的是全 0 的页
+ * 持有 g_flush_lock，避免 image_flush 在块被释放后才去写它
+ * @return 成功返回 0，写回失败或快照期间不能写回返回 -errno，块保持在内存里
+ */
+static int evict_block(size_t i)
+{
+    int ret = 0;
+    size_t len = block_len(i);
+    size_t first = (g_cache_pinned + i * g_cache_block) / DIRTY_BLOCK_SIZE;
+    size_t count = (len + DIRTY_BLOCK_SIZE - 1) / DIRTY_BLOCK_SIZE;
+
+    pthread_mutex_lock(&g_flush_lock);
+
+    // 快照的子进程可能还要从镜像文件读这个块，这期间只淘汰干净的块；
+    // 日志里有旧内容的块要等检查点连同日志一起写，不能绕过日志直接写回
+    if ((g_snapshot_pid > 0 || scan_bits(g_journaled, first, count, 0)) && scan_bits(g_dirty, first, count, 0)) {
+        pthread_mutex_unlock(&g_flush_lock);
+        return -EBUSY;
+    }
+
+    if (scan_bits(g_dirty, first, count, 1)) {
+        ret = write_range(first, first + count, 0);
+        if (ret != 0)
+            image_mark_dirty(block_addr(i), len);
+        else
+            g_cache_stats.writebacks++;
+    }
+
+    if (ret == 0)
+        madvise(block_addr(i), g_cache_block, MADV_DONTNEED);
+
+    pthread_mutex_unlock(&g_flush_lock);
+
+    return ret;
+}
+
+/**
+ * 用 CLOCK 算法找一个没有被钉住、最近没被访问的块淘汰，持有 g_cache_lock 时调用
+ * @return 淘汰了一个块返回 1，所有块都在使用中返回 0
+ */
+static int evict_one(void)
+{
+    // 转两圈：第一圈清除访问位，第二圈一定能找到可以淘汰的块（如果有的话）
+    for (size_t scanned = 0; scanned < 2 * g_cache_blocks; scanned++) {
+        size_t i = g_cache_hand;
+        g_cache_hand = (g_cache_hand + 1) % g_cache_blocks;
+
+        uint8_t state = g_block_state[i];
+        if (!(state & BLOCK_RESIDENT) || (state & BLOCK_STICKY) || g_block_pins[i] != 0)
+            continue;
+
+        if (state & BLOCK_REFERENCED) {
+            g_block_state[i] = state & ~BLOCK_REFERENCED;
+            continue;
+        }
+
+        if (evict_block(i) != 0)
+            continue;
+
+        g_block_state[i] = 0;
+        g_cache_stats.resident--;
+        g_cache_stats.evictions++;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * 读入并钉住一段镜像内存涉及的块
+ * 没读入的块由当前线程一起提交读取，读取期间不持有 g_cache_lock；别的线程正在读入的块等它完成
+ * @param sticky 为 1 则块一直常驻，返回时不保留钉住
+ */
+static int cache_acquire(const void *addr, size_t len, int overwrite, int sticky)
+{
+    size_t first, last;
+    if (!cache_range(addr, len, &first, &last))
+        return 0;
+
+    const char *start = addr;
+    const char *end = start + len;
+    size_t count = last - first + 1;
+    struct IoRequest stack_reqs[8];
+    struct IoRequest *reqs = count <= 8 ? stack_reqs : malloc(count * sizeof(struct IoRequest));
+    if (reqs == NULL)
+        return -ENOMEM;
+
+    size_t nreqs = 0;
+    int ret = 0;
+
+    pthread_mutex_lock(&g_cache_lock);
+
+    for (size_t i = first; i <= last; i++) {
+        char *block = block_addr(i);
+
+        g_block_pins[i]++;
+
+        // 别的线程正在读入的块也算命中，不需要再读一次
+        if (g_block_state[i] & (BLOCK_RESIDENT | BLOCK_LOADING)) {
+            g_cache_stats.hits++;
+        } else {
+            g_cache_stats.misses++;
+
+            while (g_cache_stats.resident >= g_cache_limit && evict_one())
+                ;
+            g_cache_stats.resident++;
+
+            // 整块都会被覆盖则不用读，没读入过的页内容是 0
+            if (overwrite && block >= start && block + block_len(i) <= end) {
+                g_block_state[i] = BLOCK_RESIDENT;
+            } else if (nreqs > 0 && reqs[nreqs - 1].buf + reqs[nreqs - 1].len == block) {
+                // 和上一个请求相邻，在文件和内存里都是连续的，合并成一次读取
+                g_block_state[i] = BLOCK_LOADING;
+                reqs[nreqs - 1].len += block_len(i);
+            } else {
+                g_block_state[i] = BLOCK_LOADING;
+                reqs[nreqs].buf = block;
+                reqs[nreqs].len = block_len(i);
+                reqs[nreqs].pos = (off_t) (g_cache_pinned + i * g_cache_block);
+                reqs[nreqs].write = 0;
+                nreqs++;
+            }
+        }
+
+        g_block_state[i] |= BLOCK_REFERENCED | (sticky ? BLOCK_STICKY : 0);
+    }
+
+    if (nreqs > 0) {
+        // 钉住的块不会被淘汰，读文件时放开锁，其他线程不用等这次读取
+        pthread_mutex_unlock(&g_cache_lock);
+        ret = io_run(g_image_fd, reqs, nreqs);
+        pthread_mutex_lock(&g_cache_lock);
+
+        for (size_t k = 0; k < nreqs; k++) {
+            size_t i = (size_t) (reqs[k].buf - block_addr(0)) / g_cache_block;
+            size_t n = (reqs[k].len + g_cache_block - 1) / g_cache_block;
+
+            for (; n > 0; n--, i++) {
+                if (ret == 0) {
+                    g_block_state[i] = (g_block_state[i] & ~BLOCK_LOADING) | BLOCK_RESIDENT;
+                } else {
+                    madvise(block_addr(i), g_cache_block, MADV_DONTNEED);
+                    g_block_state[i] = 0;
+                    g_cache_stats.resident--;
+                }
+            }
+        }
+
+        pthread_cond_broadcast(&g_cache_loaded);
+    }
+
+    // 等待别的线程读入的块，它们读取失败时这里也失败
+    for (size_t i = first; i <= last; i++) {
+        while (g_block_state[i] & BLOCK_LOADING)
+            pthread_cond_wait(&g_cache_loaded, &g_cache_lock);
+
+        if (ret == 0 && !(g_block_state[i] & BLOCK_RESIDENT))
+            ret = -EIO;
+    }
+
+    if (ret != 0 || sticky) {
+        for (size_t i = first; i <= last; i++)
+            g_block_pins[i]--;
+    }
+
+    pthread_mutex_unlock(&g_cache_lock);
+
+    if (reqs != stack_reqs)
+        free(reqs);
+
+    if (ret != 0)
+        fuse_log(FUSE_LOG_ERR, "image: failed to load block: %d\n", ret);
+
+    return ret;
+}
+
+int image_acquire(const void *addr, size_t len, int overwrite)
+{
+    return cache_acquire(addr, len, overwrite, 0);
+}
+
+void image_release(const void *addr, size_t len)
+{
+    size_t first, last;
+    if (!cache_range(addr, len, &first, &last))
+        return;
+
+    pthread_mutex_lock(&g_cache_lock);
+
+    for (size_t i = first; i <= last; i++) {
+        assert(g_block_pins[i] > 0);
+        g_block_pins[i]--;
+    }
+
+    pthread_mutex_unlock(&g_cache_lock);
+}
+
+int image_pin(const void *addr, size_t len)
+{
+    return cache_acquire(addr, len, 0, 1);
+}
+
+void image_cache_stats(struct ImageCacheStats *stats)
+{
+    // 后台读入不算按需载入
+    if (g_cache_budget == 0) {
+        memset(stats, 0, sizeof(*stats));
+        return;
+    }
+
+    pthread_mutex_lock(&g_cache_lock);
+    *stats = g_cache_stats;
+    pthread_mutex_unlock(&g_cache_lock);
+}
+
+/**
+ * 后台读入的线程：每次领取 LOAD_CHUNK_SIZE 大小的一段块，已经被访问读入的块算命中，不会重复读
+ * 最后结束的线程确认所有块都已读入
+ */
+static void *prefetch_thread(void *arg)
+{
+    (void) arg;
+
+    size_t step = LOAD_CHUNK_SIZE / g_cache_block > 0 ? LOAD_CHUNK_SIZE / g_cache_block : 1;
+
+    while (!__atomic_load_n(&g_prefetch_stop, __ATOMIC_RELAXED)) {
+        size_t first = __atomic_fetch_add(&g_prefetch_next, step, __ATOMIC_RELAXED);
+        if (first >= g_cache_blocks)
+            break;
+
+        size_t count = g_cache_blocks - first < step ? g_cache_blocks - first : step;
+        char *addr = block_addr(first);
+        size_t len = (count - 1) * g_cache_block + block_len(first + count - 1);
+
+        if (cache_acquire(addr, len, 0, 0) != 0) {
+            __atomic_store_n(&g_prefetch_failed, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        image_release(addr, len);
+    }
+
+    if (__atomic_sub_fetch(&g_prefetch_running, 1, __ATOMIC_ACQ_REL) == 0 &&
+        !__atomic_load_n(&g_prefetch_stop, __ATOMIC_RELAXED) && !__atomic_load_n(&g_prefetch_failed, __ATOMIC_RELAXED)) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double ms = (double) (now.tv_sec - g_prefetch_start.tv_sec) * 1e3 +
+                    (double) (now.tv_nsec - g_prefetch_start.tv_nsec) / 1e6;
+        fuse_log(FUSE_LOG_INFO, "image: loaded %zu MiB in the background in %.1f ms (%u threads)\n",
+                 g_image_size >> 20, ms, g_prefetcher_count);
+
+        __atomic_store_n(&g_cache_complete, 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+/**
+ * 启动后台读入的线程，一个都启动不了时所有块都在第一次访问时读入
+ */
+static void prefetch_start(void)
+{
+    g_prefetch_next = 0;
+    g_prefetch_stop = 0;
+    g_prefetch_failed = 0;
+    g_prefetch_running = g_prefetch_threads;
+    clock_gettime(CLOCK_MONOTONIC, &g_prefetch_start);
+
+    g_prefetchers = malloc(g_prefetch_threads * sizeof(pthread_t));
+    if (g_prefetchers == NULL) {
+        fuse_log(FUSE_LOG_WARNING, "image: failed to start background loading\n");
+        return;
+    }
+
+    // 线程还没全部创建时 g_prefetch_running 偏大，先结束的线程不会误以为全部读完
+    for (; g_prefetcher_count < g_prefetch_threads; g_prefetcher_count++) {
+        if (pthread_create(&g_prefetchers[g_prefetcher_count], NULL, prefetch_thread, NULL) != 0)
+            break;
+    }
+
+    unsigned missing = g_prefetch_threads - g_prefetcher_count;
+    if (missing > 0) {
+        fuse_log(FUSE_LOG_WARNING, "image: started %u of %u background loading threads\n", g_prefetcher_count,
+                 g_prefetch_threads);
+        // 没创建出来的线程不会减少计数，替它们减掉；一个都没有时块都在访问时读入
+        if (__atomic_sub_fetch(&g_prefetch_running, missing, __ATOMIC_ACQ_REL) == 0 && g_prefetcher_count > 0 &&
+            !__atomic_load_n(&g_prefetch_failed, __ATOMIC_RELAXED))
+            __atomic_store_n(&g_cache_complete, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * 停止后台读入的线程，没读入的块留在文件里
+ */
+static void prefetch_stop(void)
+{
+    __atomic_store_n(&g_prefetch_stop, 1, __ATOMIC_RELAXED);
+
+    for (unsigned i = 0; i < g_prefetcher_count; i++)
+        pthread_join(g_prefetchers[i], NULL);
+
+    free(g_prefetchers);
+    g_prefetchers = NULL;
+    g_prefetcher_count = 0;
+    g_cache_complete = 0;
+}
+
+/**
+ * 在位图中标记一段内存涉及的块
+ */
+static void mark_bits(uint64_t *bitmap, const void *addr, size_t len)
+{
+    // 不在镜像内的地址（比如已删除但仍被打开的文件的目录项）无需回写
+    if (len == 0 || (const char *) addr < g_image || (const char *) addr >= g_image + g_image_size)
+        return;
+
+    size_t start = ((const char *) addr - g_image);
+    assert(start + len <= g_image_size);
+
+    size_t first = start / DIRTY_BLOCK_SIZE;
+    size_t last = (start + len - 1) / DIRTY_BLOCK_SIZE;
+
+    // 多个线程会同时标记同一个字里的不同位
+    for (size_t i = first; i <= last; i++) {
+        uint64_t bit = (uint64_t) 1 << (i % BITS_PER_WORD);
+        if (!(__atomic_load_n(&bitmap[i / BITS_PER_WORD], __ATOMIC_RELAXED) & bit))
+            __atomic_fetch_or(&bitmap[i / BITS_PER_WORD], bit, __ATOMIC_RELEASE);
+    }
+}
+
+void image_mark_dirty(const void *addr, size_t len)
+{
+    // 先标记元数据，取走脏标记的一方看到脏标记时也能看到元数据标记
+    mark_bits(g_meta, addr, len);
+    mark_bits(g_dirty, addr, len);
+}
+
+void image_mark_data(const void *addr, size_t len)
+{
+    mark_bits(g_dirty, addr, len);
+}
+
+/**
+ * 在镜像文件里给 [start, end) 范围内的块打洞，不支持打洞时什么都不做
+ * @return 释放的字节数
+ */
+static size_t punch_range(size_t start, size_t end)
+{
+    size_t pos = start * DIRTY_BLOCK_SIZE;
+    size_t stop = end * DIRTY_BLOCK_SIZE < g_image_size ? end * DIRTY_BLOCK_SIZE : g_image_size;
+
+    if (g_punch_unsupported || stop <= pos)
+        return 0;
+
+    if (fallocate(g_image_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) pos, (off_t) (stop - pos)) != 0) {
+        if (errno == EOPNOTSUPP) {
+            fuse_log(FUSE_LOG_INFO, "image: file system does not support punching holes\n");
+            g_punch_unsupported = 1;
+        } else {
+            fuse_log(FUSE_LOG_ERR, "image: failed to punch a hole: %d\n", -errno);
+        }
+        return 0;
+    }
+
+    return stop - pos;
+}
+
+void image_discard(const void *addr, size_t len)
+{
+    if (len == 0 || (const char *) addr < g_image || (const char *) addr >= g_image + g_image_size)
+        return;
+
+    size_t start = ((const char *) addr - g_image);
+    assert(start % DIRTY_BLOCK_SIZE == 0 && start + len <= g_image_size);
+
+    size_t first = start / DIRTY_BLOCK_SIZE;
+    size_t count = (len + DIRTY_BLOCK_SIZE - 1) / DIRTY_BLOCK_SIZE;
+
+    // mmap 模式下内存就是文件，调用者还独占这些块，直接打洞
+    if (g_image_mmap) {
+        punch_range(first, first + count);
+        return;
+    }
+
+    // 没写回的内容不用再写，等释放它们的元数据写出之后再打洞
+    scan_bits(g_dirty, first, count, 1);
+    scan_bits(g_meta, first, count, 1);
+    mark_bits(g_discard, addr, len);
+}
+
+/**
+ * 给标记为释放的块打洞，相邻的块合并成一次
+ * @param bitmap 取走的释放标记；为 NULL 则直接从 g_discard 取走
+ * @return 释放的字节数
+ */
+static size_t punch_discarded(const uint64_t *bitmap)
+{
+    size_t bytes = 0;
+    size_t run_start = 0;
+    int in_run = 0;
+
+    for (size_t w = 0; w <= g_dirty_words; w++) {
+        uint64_t word = 0;
+        if (w < g_dirty_words) {
+            if (bitmap != NULL)
+                word = bitmap[w];
+            else if (__atomic_load_n(&g_discard[w], __ATOMIC_RELAXED) != 0)
+                word = __atomic_exchange_n(&g_discard[w], 0, __ATOMIC_ACQ_REL);
+        }
+
+        if ((in_run && word == UINT64_MAX) || (!in_run && word == 0))
+            continue;
+
+        for (size_t bit = 0; bit < BITS_PER_WORD; bit++) {
+            int discarded = (word >> bit) & 1;
+            size_t i = w * BITS_PER_WORD + bit;
+
+            if (discarded && !in_run) {
+                run_start = i;
+                in_run = 1;
+            } else if (!discarded && in_run) {
+                bytes += punch_range(run_start, i);
+                in_run = 0;
+            }
+        }
+    }
+
+    return bytes;
+}
+
+void image_zero(void *addr, size_t len)
+{
+    char *start = addr;
+    char *end = start + len;
+
+    if (len == 0)
+        return;
+
+    // mmap 模式下内存就是文件，打洞之后读到的就是 0，不产生写回
+    if (g_image_mmap && (size_t) (start - g_image) % DIRTY_BLOCK_SIZE == 0 && len % DIRTY_BLOCK_SIZE == 0) {
+        size_t first = (size_t) (start - g_image) / DIRTY_BLOCK_SIZE;
+        if (punch_range(first, first + len / DIRTY_BLOCK_SIZE) == len)
+            return;
+    }
+
+    // 中间整页的部分换成零页，两头不满一页的部分直接清零
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    char *first_page = (char *) (((uintptr_t) start + page - 1) / page * page);
+    char *last_page = (char *) ((uintptr_t) end / page * page);
+    if (!g_image_mmap && first_page < last_page &&
+        madvise(first_page, (size_t) (last_page - first_page), MADV_DONTNEED) == 0) {
+        memset(start, 0, (size_t) (first_page - start));
+        memset(last_page, 0, (size_t) (end - last_page));
+    } else {
+        memset(start, 0, len);
+    }
+
+    image_mark_data(addr, len);
+}
+
+/**
+ * 持有 g_flush_lock 时调用，等待快照的子进程不再需要读镜像文件
+ */
+static void wait_snapshot(void)
+{
+    while (g_snapshot_pid > 0)
+        pthread_cond_wait(&g_snapshot_done, &g_flush_lock);
+}
+
+/**
+ * 写回 [start, end) 范围内的块
+ * @return 成功返回 0，失败返回 -errno
+ */
+static int write_range(size_t start, size_t end, int sync)
+{
+    size_t pos = start * DIRTY_BLOCK_SIZE;
+    size_t stop = end * DIRTY_BLOCK_SIZE;
+    if (stop > g_image_size)
+        stop = g_image_size;
+
+    if (g_image_mmap) {
+        // msync 要求起始地址按页对齐
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        size_t begin = pos / page * page;
+        if (msync(g_image + begin, stop - begin, sync ? MS_SYNC : MS_ASYNC) != 0)
+            return -errno;
+        return 0;
+    }
+
+    struct IoRequest req = {g_image + pos, stop - pos, (off_t) pos, 1};
+    return io_run(g_image_fd, &req, 1);
+}
+
+// 回写时攒起来一起提交的写请求
+struct WriteBatch {
+    struct IoRequest reqs[FLUSH_BATCH];
+    size_t count;
+    int ret;                    // 第一个出错的 -errno
+};
+
+static void batch_submit(struct WriteBatch *batch)
+{
+    int err = io_run(g_image_fd, batch->reqs, batch->count);
+    if (err != 0 && batch->ret == 0)
+        batch->ret = err;
+    batch->count = 0;
+}
+
+/**
+ * 回写 [start, end) 范围内的块：mmap 模式下直接 msync，反之放入 batch，攒满了再一起提交
+ * @param buf 要写入的内容，为 NULL 则直接写内存中的镜像
+ */
+static void batch_add(struct WriteBatch *batch, size_t start, size_t end, const char *buf, int sync)
+{
+    if (g_image_mmap) {
+        int err = write_range(start, end, sync);
+        if (err != 0 && batch->ret == 0)
+            batch->ret = err;
+        return;
+    }
+
+    size_t pos = start * DIRTY_BLOCK_SIZE;
+    size_t stop = end * DIRTY_BLOCK_SIZE;
+    if (stop > g_image_size)
+        stop = g_image_size;
+
+    struct IoRequest *req = &batch->reqs[batch->count++];
+    req->buf = buf != NULL ? (char *) buf : g_image + pos;
+    req->len = stop - pos;
+    req->pos = (off_t) pos;
+    req->write = 1;
+
+    if (batch->count == FLUSH_BATCH)
+        batch_submit(batch);
+}
+
+int image_flush(int sync)
+{
+    int ret;
+    size_t run_start = 0;
+    int in_run = 0;
+    struct WriteBatch batch;
+    batch.count = 0;
+    batch.ret = 0;
+
+    pthread_mutex_lock(&g_flush_lock);
+    wait_snapshot();
+
+    // 先清除标记再回写，回写期间又被修改的块会重新被标记，下次再写
+    // 取走的标记记在检查点的位图里（检查点也持有 g_flush_lock，两者不会同时使用），写失败时放回
+    for (size_t w = 0; w < g_dirty_words; w++) {
+        uint64_t word = __atomic_load_n(&g_dirty[w], __ATOMIC_RELAXED);
+        uint64_t meta = 0;
+        if (word != 0) {
+            word = __atomic_exchange_n(&g_dirty[w], 0, __ATOMIC_ACQ_REL);
+            meta = __atomic_fetch_and(&g_meta[w], ~word, __ATOMIC_RELAXED) & word;
+            // 释放后又被分配出去并写过的块，这次写入新内容，不能再打洞
+            __atomic_fetch_and(&g_discard[w], ~word, __ATOMIC_RELAXED);
+        }
+
+        g_cp_dirty[w] = word;
+        g_cp_meta[w] = meta;
+
+        // 整个字的状态和当前是否在脏块区间内一致，不用逐位检查
+        if ((in_run && word == UINT64_MAX) || (!in_run && word == 0))
+            continue;
+
+        for (size_t bit = 0; bit < BITS_PER_WORD; bit++) {
+            int dirty = (word >> bit) & 1;
+            size_t i = w * BITS_PER_WORD + bit;
+
+            if (dirty && !in_run) {
+                run_start = i;
+                in_run = 1;
+            } else if (!dirty && in_run) {
+                batch_add(&batch, run_start, i, NULL, sync);
+                in_run = 0;
+            }
+        }
+    }
+
+    if (in_run)
+        batch_add(&batch, run_start, g_dirty_words * BITS_PER_WORD, NULL, sync);
+
+    if (batch.count > 0)
+        batch_submit(&batch);
+
+    punch_discarded(NULL);
+
+    ret = batch.ret;
+
+    if (ret == 0 && sync && !g_image_mmap && fdatasync(g_image_fd) != 0)
+        ret = -errno;
+
+    // 写失败的块放回标记，下次再写；它们仍在使用中，释放标记不用放回
+    if (ret != 0) {
+        for (size_t w = 0; w < g_dirty_words; w++) {
+            __atomic_fetch_or(&g_meta[w], g_cp_meta[w], __ATOMIC_RELAXED);
+            __atomic_fetch_or(&g_dirty[w], g_cp_dirty[w], __ATOMIC_RELEASE);
+        }
+    }
+
+    pthread_mutex_unlock(&g_flush_lock);
+
+    if (ret != 0)
+        fuse_log(FUSE_LOG_ERR, "image: writeback failed: %d\n", ret);
+
+    return ret;
+}
+
+int image_checkpoint_begin(void)
+{
+    size_t meta_bytes = 0;
+
+    pthread_mutex_lock(&g_flush_lock);
+
+    // 取走所有标记，之后的修改属于下一个检查点
+    for (size_t w = 0; w < g_dirty_words; w++) {
+        uint64_t word = __atomic_load_n(&g_dirty[w], __ATOMIC_RELAXED);
+        uint64_t meta = 0;
+        if (word != 0) {
+            word = __atomic_exchange_n(&g_dirty[w], 0, __ATOMIC_ACQ_REL);
+            meta = __atomic_fetch_and(&g_meta[w], ~word, __ATOMIC_RELAXED) & word;
+            __atomic_fetch_and(&g_discard[w], ~word, __ATOMIC_RELAXED);
+        }
+
+        // 切点时已经被释放的块，释放它们的元数据写出之后打洞
+        g_cp_discard[w] = __atomic_load_n(&g_discard[w], __ATOMIC_RELAXED) != 0 ?
+                          __atomic_exchange_n(&g_discard[w], 0, __ATOMIC_ACQ_REL) : 0;
+
+        // 日志里有这个块旧的内容时（比如目录的簇被释放后又分配给了文件），新的内容也要写进日志，
+        // 否则重放时旧的内容会覆盖它
+        meta |= word & g_journaled[w];
+
+        g_cp_dirty[w] = word;
+        g_cp_meta[w] = meta;
+        meta_bytes += (size_t) __builtin_popcountll(meta) * DIRTY_BLOCK_SIZE;
+    }
+
+    // mmap 模式下内存就是文件，进程崩溃也不会丢失，不需要复制
+    if (g_image_mmap || meta_bytes == 0)
+        return 0;
+
+    g_cp_copy = malloc(meta_bytes);
+    if (g_cp_copy == NULL) {
+        // 放回标记，下次再试
+        for (size_t w = 0; w < g_dirty_words; w++) {
+            __atomic_fetch_or(&g_meta[w], g_cp_meta[w], __ATOMIC_RELAXED);
+            __atomic_fetch_or(&g_dirty[w], g_cp_dirty[w], __ATOMIC_RELEASE);
+            __atomic_fetch_or(&g_discard[w], g_cp_discard[w], __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&g_flush_lock);
+        return -ENOMEM;
+    }
+
+    char *p = g_cp_copy;
+    for (size_t w = 0; w < g_dirty_words; w++) {
+        for (uint64_t meta = g_cp_meta[w]; meta != 0; meta &= meta - 1) {
+            size_t i = w * BITS_PER_WORD + (size_t) __builtin_ctzll(meta);
+            size_t pos = i * DIRTY_BLOCK_SIZE;
+            size_t len = g_image_size - pos < DIRTY_BLOCK_SIZE ? g_image_size - pos : DIRTY_BLOCK_SIZE;
+            memcpy(p, g_image + pos, len);
+            p += DIRTY_BLOCK_SIZE;
+        }
+    }
+
+    return 0;
+}
+
+// 检查点中块的种类
+#define CP_DATA 0x01
+#define CP_META 0x02
+
+/**
+ * 写出检查点中指定种类的块，相邻的同类块合并成一次写入
+ * 元数据从切点的副本写，数据直接写内存中的镜像
+ * 数据可能正被其他线程改写，改动会重新标记为脏，下一个检查点再写一遍
+ * @param kinds 要写的种类，CP_DATA 和 CP_META 的组合
+ */
+static void checkpoint_write(struct WriteBatch *batch, int kinds, struct CheckpointStats *stats)
+{
+    size_t blocks = g_dirty_words * BITS_PER_WORD;
+    size_t run_start = 0;
+    size_t run_copy = 0;        // 区间的第一个块在副本中的序号
+    size_t meta_seen = 0;       // 已经经过的元数据块数
+    int run_kind = 0;           // 0 表示不在区间内
+
+    for (size_t i = 0; i <= blocks; i++) {
+        int kind = 0;
+        if (i < blocks) {
+            uint64_t bit = (uint64_t) 1 << (i % BITS_PER_WORD);
+            if (g_cp_dirty[i / BITS_PER_WORD] & bit)
+                kind = (g_cp_meta[i / BITS_PER_WORD] & bit) ? CP_META : CP_DATA;
+            else if (run_kind == 0 && i % BITS_PER_WORD == 0 && g_cp_dirty[i / BITS_PER_WORD] == 0) {
+                i += BITS_PER_WORD - 1;  // 整个字都是干净的
+                continue;
+            }
+        }
+
+        int selected = kind & kinds;
+        if (selected != run_kind) {
+            if (run_kind != 0) {
+                const char *buf = NULL;
+                if (run_kind == CP_META && g_cp_copy != NULL)
+                    buf = g_cp_copy + run_copy * DIRTY_BLOCK_SIZE;
+                batch_add(batch, run_start, i, buf, 0);
+
+                size_t len = (i - run_start) * DIRTY_BLOCK_SIZE;
+                if (run_start * DIRTY_BLOCK_SIZE + len > g_image_size)
+                    len = g_image_size - run_start * DIRTY_BLOCK_SIZE;
+                stats->bytes += len;
+                if (run_kind == CP_META)
+                    stats->meta_bytes += len;
+            }
+
+            run_start = i;
+            run_copy = meta_seen;
+            run_kind = selected;
+        }
+
+        if (kind == CP_META)
+            meta_seen++;
+    }
+
+    if (batch->count > 0)
+        batch_submit(batch);
+}
+
+// 切点里元数据块的数量
+static size_t checkpoint_meta_count(void)
+{
+    size_t count = 0;
+    for (size_t w = 0; w < g_dirty_words; w++)
+        count += (size_t) __builtin_popcountll(g_cp_meta[w]);
+
+    return count;
+}
+
+/**
+ * 把切点复制的元数据作为一个事务追加到日志，返回时事务已经落盘
+ * @return 成功返回 0，失败返回 -errno
+ */
+static int checkpoint_journal(struct CheckpointStats *stats)
+{
+    size_t count = checkpoint_meta_count();
+    if (count == 0)
+        return 0;
+
+    size_t *blocks = malloc(count * sizeof(size_t));
+    if (blocks == NULL)
+        return -ENOMEM;
+
+    size_t n = 0;
+    for (size_t w = 0; w < g_dirty_words; w++) {
+        for (uint64_t meta = g_cp_meta[w]; meta != 0; meta &= meta - 1)
+            blocks[n++] = w * BITS_PER_WORD + (size_t) __builtin_ctzll(meta);
+    }
+
+    int ret = journal_append(blocks, g_cp_copy, count, 1);
+    free(blocks);
+
+    if (ret == 0) {
+        stats->journal_bytes = count * DIRTY_BLOCK_SIZE;
+        for (size_t w = 0; w < g_dirty_words; w++)
+            g_journaled[w] |= g_cp_meta[w];
+    }
+
+    return ret;
+}
+
+int image_checkpoint_end(struct CheckpointStats *stats, int sync)
+{
+    struct WriteBatch batch;
+    batch.count = 0;
+    batch.ret = 0;
+
+    stats->bytes = 0;
+    stats->meta_bytes = 0;
+    stats->journal_bytes = 0;
+    stats->discard_bytes = 0;
+
+    // 切点已经建立，等快照结束期间修改可以继续
+    wait_snapshot();
+
+    if (!journal_is_open()) {
+        checkpoint_write(&batch, CP_DATA | CP_META, stats);
+
+        if (batch.ret == 0 && sync && !g_image_mmap && fdatasync(g_image_fd) != 0)
+            batch.ret = -errno;
+    } else {
+        // 先写文件数据，提交的元数据引用到的簇在事务落盘前已经写好
+        checkpoint_write(&batch, CP_DATA, stats);
+
+        // 有元数据要写回原处时，不管是否 sync，文件数据和事务都要先落盘：
+        // 原处的写入可能比日志先到达磁盘，断电后就没有事务能重放它
+        int meta = checkpoint_meta_count() > 0;
+        if (batch.ret == 0 && (sync || meta) && fdatasync(g_image_fd) != 0)
+            batch.ret = -errno;
+
+        if (batch.ret == 0)
+            batch.ret = checkpoint_journal(stats);
+
+        // 提交之后才把元数据写回原处，写到一半崩溃时由日志重放
+        if (batch.ret == 0)
+            checkpoint_write(&batch, CP_META, stats);
+
+        // 日志里的内容都写回原处之后，镜像落盘了才能清空日志
+        if (batch.ret == 0 && journal_size() > JOURNAL_RESET_SIZE) {
+            if (fdatasync(g_image_fd) != 0 || journal_reset() != 0)
+                fuse_log(FUSE_LOG_ERR, "image: failed to truncate the journal\n");
+            else
+                memset(g_journaled, 0, g_dirty_words * sizeof(uint64_t));
+        }
+    }
+
+    if (batch.ret == 0)
+        stats->discard_bytes = punch_discarded(g_cp_discard);
+
+    free(g_cp_copy);
+    g_cp_copy = NULL;
+
+    // 写失败的部分放回标记，下次再写
+    if (batch.ret != 0) {
+        for (size_t w = 0; w < g_dirty_words; w++) {
+            __atomic_fetch_or(&g_meta[w], g_cp_meta[w], __ATOMIC_RELAXED);
+            __atomic_fetch_or(&g_dirty[w], g_cp_dirty[w], __ATOMIC_RELEASE);
+            __atomic_fetch_or(&g_discard[w], g_cp_discard[w], __ATOMIC_RELAXED);
+        }
+    }
+
+    pthread_mutex_unlock(&g_flush_lock);
+
+    if (batch.ret != 0)
+        fuse_log(FUSE_LOG_ERR, "image: checkpoint failed: %d\n", batch.ret);
+
+    return batch.ret;
+}
+
+/**
+ * 快照的一段内容是否全为 0，全 0 的部分不写，留作文件空洞
+ */
+static int is_zero(const char *buf, size_t len)
+{
+    return len == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, len - 1) == 0);
+}
+
+/**
+ * 在快照文件的 pos 处写入一段内容
+ * @return 成功返回 0，失败返回 -1
+ */
+static int snapshot_write(int out, const char *buf, size_t len, size_t pos)
+{
+    if (is_zero(buf, len))
+        return 0;
+
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(out, buf + done, len - done, (off_t) (pos + done));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += (size_t) n;
+    }
+
+    return 0;
+}
+
+/**
+ * 快照的子进程：内存是 fork 时的写时复制副本，把整个镜像写到 tmp，再改名为 path
+ * fork 之后其他线程持有的锁（包括 malloc 内部的）可能永远不会释放，这里只用系统调用
+ * @param buf 预先分配好的缓冲区，用来读没在内存里的块，大小至少为一个块
+ */
+static void snapshot_child(int out, const char *tmp, const char *path, char *buf)
+{
+    int ok = ftruncate(out, (off_t) g_image_size) == 0;
+
+    if (g_cache_blocks == 0) {
+        for (size_t pos = 0; ok && pos < g_image_size; pos += SNAPSHOT_CHUNK) {
+            size_t len = g_image_size - pos < SNAPSHOT_CHUNK ? g_image_size - pos : SNAPSHOT_CHUNK;
+            ok = snapshot_write(out, g_image + pos, len, pos) == 0;
+        }
+    } else {
+        ok = ok && snapshot_write(out, g_image, g_cache_pinned, 0) == 0;
+
+        // 没在内存里的块（包括正在读入的）在文件里的内容就是最新的，父进程在子进程结束前不会改写
+        for (size_t i = 0; ok && i < g_cache_blocks; i++) {
+            size_t len = block_len(i);
+            size_t pos = g_cache_pinned + i * g_cache_block;
+            const char *src = block_addr(i);
+
+            if ((g_block_state[i] & (BLOCK_RESIDENT | BLOCK_LOADING)) != BLOCK_RESIDENT) {
+                ssize_t n = pread(g_image_fd, buf, len, (off_t) pos);
+                while (n < 0 && errno == EINTR)
+                    n = pread(g_image_fd, buf, len, (off_t) pos);
+                ok = n == (ssize_t) len;
+                src = buf;
+            }
+
+            ok = ok && snapshot_write(out, src, len, pos) == 0;
+        }
+    }
+
+    ok = ok && fdatasync(out) == 0 && rename(tmp, path) == 0;
+    if (!ok)
+        unlink(tmp);
+
+    _exit(ok ? 0 : 1);
+}
+
+pid_t image_snapshot_begin(const char *path)
+{
+    if (g_image_mmap)
+        return -EOPNOTSUPP;
+
+    // 先写到临时文件，完整写完才改名，path 要么是旧的快照要么是完整的新快照
+    char *tmp = malloc(strlen(path) + sizeof(".tmp"));
+    char *buf = malloc(g_cache_blocks > 0 ? g_cache_block : 1);
+    if (tmp == NULL || buf == NULL) {
+        free(tmp);
+        free(buf);
+        return -ENOMEM;
+    }
+    sprintf(tmp, "%s.tmp", path);
+
+    int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        int ret = -errno;
+        free(tmp);
+        free(buf);
+        return ret;
+    }
+
+    // 块的状态和内存一致（没有淘汰到一半的块），正在进行的回写也已经完成
+    pthread_mutex_lock(&g_cache_lock);
+    pthread_mutex_lock(&g_flush_lock);
+
+    pid_t pid = fork();
+    if (pid == 0)
+        snapshot_child(out, tmp, path, buf);
+
+    int ret = pid < 0 ? -errno : 0;
+    // 后台读入完成后子进程不需要读镜像文件
+    if (pid > 0 && g_cache_blocks > 0 && !__atomic_load_n(&g_cache_complete, __ATOMIC_ACQUIRE))
+        g_snapshot_pid = pid;
+
+    pthread_mutex_unlock(&g_flush_lock);
+    pthread_mutex_unlock(&g_cache_lock);
+
+    if (pid < 0)
+        unlink(tmp);
+
+    close(out);
+    free(tmp);
+    free(buf);
+
+    return pid < 0 ? ret : pid;
+}
+
+int image_snapshot_end(pid_t pid)
+{
+    int status;
+    int ret = 0;
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            ret = -errno;
+            break;
+        }
+    }
+
+    if (ret == 0 && !(WIFEXITED(status) && WEXITSTATUS(status) == 0))
+        ret = -EIO;
+
+    pthread_mutex_lock(&g_flush_lock);
+    if (g_snapshot_pid == pid) {
+        g_snapshot_pid = 0;
+        pthread_cond_broadcast(&g_snapshot_done);
+    }
+    pthread_mutex_unlock(&g_flush_lock);
+
+    return ret;
+}
+
+int image_close(void)
+{
+    int ret = 0;
+
+    if (g_image == NULL)
+        return 0;
+
+    // 后台读入还没完成就卸载时先停下，没读入的块不需要回写
+    prefetch_stop();
+
+    // 只有被改过的扇区需要回写
+    if (image_flush(0) != 0)
+        ret = -1;
+
+    // 所有修改都在镜像里落盘后日志就没用了，失败则保留日志，下次挂载时重放
+    if (journal_is_open()) {
+        if (ret == 0 && (fdatasync(g_image_fd) != 0 || journal_reset() != 0))
+            fuse_log(FUSE_LOG_ERR, "image: failed to truncate the journal\n");
+        journal_close();
+    }
+
+    if (g_image_mmap) {
+        munmap(g_image, g_image_size);
+    } else if (g_cache_blocks > 0) {
+        munmap(g_mapping, g_mapping_size);
+        free(g_block_state);
+        free(g_block_pins);
+        g_block_state = NULL;
+        g_block_pins = NULL;
+        g_cache_blocks = 0;
+    } else {
+        free(g_image);
+    }
+
+    io_shutdown();
+    close(g_image_fd);
+    free(g_dirty);
+    g_dirty = NULL;
+    g_image = NULL;
+    g_image_fd = -1;
+
+    return ret;
+}
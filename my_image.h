@@ -0,0 +1,179 @@
+//
+// 虚拟磁盘镜像的加载与保存
+//
+
+#ifndef MYFAT_MY_IMAGE_H
+#define MYFAT_MY_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * 不加载整个镜像，只读出文件开头的一段，用于挂载前读取引导扇区
+ * @param filename 镜像文件路径
+ * @param buf 保存读到的内容
+ * @param len 要读取的长度
+ * @param size 保存镜像文件的大小
+ * @return 成功返回 0，文件不存在或不够长返回 -1
+ */
+int image_peek(const char *filename, void *buf, size_t len, off_t *size);
+
+// 按需载入模式下的统计
+struct ImageCacheStats {
+    uint64_t hits;              // 访问时块已经在内存里
+    uint64_t misses;            // 访问时需要从文件读入
+    uint64_t evictions;         // 被淘汰的块数
+    uint64_t writebacks;        // 淘汰时需要先写回的块数
+    size_t resident;            // 当前在内存里的块数
+    size_t limit;               // 内存预算对应的块数
+    size_t block_size;          // 块大小
+};
+
+/**
+ * 设置按需载入：镜像开头的 pinned 字节在打开时读入并常驻内存，其余部分按块在第一次访问时才读入，
+ * 在内存里的块超过 budget 字节时用 CLOCK 算法淘汰没有被钉住的块，脏块淘汰前先写回
+ * 需要在 image_open 之前调用，mmap 模式下不起作用（由内核按需载入）
+ * @param budget 内存预算（字节），为 0 则不启用，整个镜像读入内存
+ * @param pinned 常驻内存的开头部分的大小
+ * @param block_size 块大小，会向上取整到页大小
+ */
+void image_set_cache(size_t budget, size_t pinned, size_t block_size);
+
+/**
+ * 设置后台读入：整个读入内存的镜像在打开时只读入开头的 pinned 字节（引导扇区、FAT 和根目录）就返回，
+ * 其余部分由后台线程按块读入，读入完成之前第一次访问某个块时先读入它（或等后台线程读完）
+ * 需要在 image_open 之前调用，mmap 模式、按需载入和新建镜像时不起作用
+ * @param pinned 打开时读入的开头部分的大小
+ * @param block_size 块大小，会向上取整到页大小
+ * @param threads 后台线程数，为 0 则不启用，打开时读入整个镜像
+ */
+void image_set_prefetch(size_t pinned, size_t block_size, unsigned threads);
+
+/**
+ * 打开镜像文件，并将其放到内存中
+ * 新建的镜像保证内容全为 0，之后需要自行格式化；已有的镜像比 size 小则打开失败
+ * @param filename 镜像文件路径
+ * @param size 镜像大小
+ * @param is_create 是否新建镜像
+ * @param use_mmap 为 1 则以 MAP_SHARED 方式映射镜像文件，由内核按需读入和回写；为 0 则整个读入到 malloc 的内存里
+ * @return 成功返回镜像在内存中的起始地址，失败返回 NULL
+ */
+char *image_open(const char *filename, size_t size, int is_create, int use_mmap);
+
+/**
+ * 保证一段镜像内存已经读入，并在 image_release 之前不会被淘汰
+ * 不是按需载入的镜像或者常驻的部分直接返回
+ * @param addr 起始地址
+ * @param len 长度
+ * @param overwrite 为 1 表示调用者会覆盖整段内容，完全被覆盖的块不必从文件读入
+ * @return 成功返回 0，读取失败返回 -errno
+ */
+int image_acquire(const void *addr, size_t len, int overwrite);
+
+/**
+ * 解除 image_acquire 的钉住，之后这段内存可能被淘汰，不能再访问
+ */
+void image_release(const void *addr, size_t len);
+
+/**
+ * 读入一段镜像内存并一直常驻，用于目录这类会被长期引用的元数据
+ * @return 成功返回 0，读取失败返回 -errno
+ */
+int image_pin(const void *addr, size_t len);
+
+/**
+ * 获取按需载入的统计，未启用时全为 0
+ */
+void image_cache_stats(struct ImageCacheStats *stats);
+
+/**
+ * 标记一段元数据（FAT、目录项等）被修改过，image_flush 时只回写被标记的扇区
+ * 检查点会在切点复制被修改的元数据，写入文件的是同一时刻的状态
+ * @param addr 被修改的起始地址，不在镜像内则忽略
+ * @param len 被修改的长度
+ */
+void image_mark_dirty(const void *addr, size_t len);
+
+/**
+ * 标记一段文件数据被修改过，和 image_mark_dirty 一样会被回写，但检查点直接写内存中最新的内容
+ * @param addr 被修改的起始地址，不在镜像内则忽略
+ * @param len 被修改的长度
+ */
+void image_mark_data(const void *addr, size_t len);
+
+/**
+ * 把一段镜像内存清零并标记为文件数据的修改，调用者需要先 image_acquire 这一段
+ * 整页的部分用 madvise 换成零页，第一次访问时才真正分配内存；mmap 模式下直接在镜像文件里打洞
+ * @param addr 起始地址
+ * @param len 长度
+ */
+void image_zero(void *addr, size_t len);
+
+/**
+ * 标记一段镜像内存不再被使用（被释放的簇）：还没写回的修改不再写回，之后回写时在镜像文件里打洞，
+ * 文件占用的空间只随着实际使用的簇增长；打洞在释放它们的元数据写出之后进行，mmap 模式下立即打洞
+ * 之后再被修改（簇被重新分配）的部分照常回写
+ * @param addr 起始地址，按扇区对齐，不在镜像内则忽略
+ * @param len 长度
+ */
+void image_discard(const void *addr, size_t len);
+
+/**
+ * 把所有被修改过的扇区写回镜像文件，相邻的扇区合并成一次写入
+ * @param sync 为 1 则等待数据落盘
+ * @return 成功返回 0，失败返回 -errno
+ */
+int image_flush(int sync);
+
+// 一次检查点的统计
+struct CheckpointStats {
+    size_t bytes;               // 写入的字节数
+    size_t meta_bytes;          // 其中在切点复制的元数据
+    size_t journal_bytes;       // 追加到日志的字节数
+    size_t discard_bytes;       // 打洞释放的字节数
+};
+
+/**
+ * 建立检查点的切点：取走所有修改标记，并复制其中的元数据
+ * 调用者在这期间阻止元数据被修改；返回后可以继续修改，之后的修改属于下一个检查点
+ * 成功时持有回写的锁，直到调用 image_checkpoint_end
+ * @return 成功返回 0，内存不足返回 -ENOMEM（标记保持不变）
+ */
+int image_checkpoint_begin(void);
+
+/**
+ * 写出检查点：元数据写切点时的副本，文件数据写内存中最新的内容
+ * 打开了日志时依次写文件数据、把元数据作为一个事务追加到日志、再把元数据写回原处，日志过长时清空；
+ * 有元数据时文件数据和事务总是先落盘，再写回原处
+ * @param stats 保存统计
+ * @param sync 为 1 则等待落盘；打开了日志时只等文件数据和日志落盘
+ * @return 成功返回 0，失败返回 -errno，没写成功的部分留到下次
+ */
+int image_checkpoint_end(struct CheckpointStats *stats, int sync);
+
+/**
+ * 开始写快照：fork 出的子进程拥有内存中镜像的写时复制副本，由它把这一刻的整个卷写到 path，空的部分留作文件空洞
+ * 调用者在调用期间阻止修改，返回后修改可以继续，只影响父进程的内存
+ * 按需载入时子进程从镜像文件读没在内存里的块，在 image_snapshot_end 之前回写会等待，淘汰只选干净的块
+ * 不支持 mmap 模式
+ * @param path 快照文件路径，先写到 path.tmp，写完整之后才改名
+ * @return 成功返回子进程号，失败返回 -errno
+ */
+pid_t image_snapshot_begin(const char *path);
+
+/**
+ * 等待快照的子进程结束
+ * @param pid image_snapshot_begin 返回的子进程号
+ * @return 快照写完整返回 0，反之返回 -errno
+ */
+int image_snapshot_end(pid_t pid);
+
+/**
+ * 把内存中被修改过的部分保存到文件，并释放内存
+ * 打开了日志时，保存并落盘之后清空日志再关闭
+ * @return 成功返回 0，失败返回 -1
+ */
+int image_close(void);
+
+#endif //MYFAT_MY_IMAGE_H
@@ -0,0 +1,211 @@
+//
+// 打开文件的内存状态
+//
+
+#include "my_inode.h"
+
+// 哈希表的桶数
+#define INODE_BUCKETS 256
+
+static struct Inode *g_inodes[INODE_BUCKETS];
+
+// 保护 g_inodes、inode->fcb 的变化和 refcount，持有它时不再获取其他锁
+static pthread_mutex_t g_inode_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t hash_fcb(const struct FCB *fcb)
+{
+    return (uint32_t) (((uintptr_t) fcb / sizeof(struct FCB)) % INODE_BUCKETS);
+}
+
+static struct Inode *find_locked(const struct FCB *fcb)
+{
+    struct Inode *inode = g_inodes[hash_fcb(fcb)];
+
+    while (inode != NULL && inode->fcb != fcb) {
+        inode = inode->next;
+    }
+
+    return inode;
+}
+
+struct Inode *inode_find(const struct FCB *fcb)
+{
+    pthread_mutex_lock(&g_inode_lock);
+    struct Inode *inode = find_locked(fcb);
+    pthread_mutex_unlock(&g_inode_lock);
+
+    return inode;
+}
+
+static void inode_unlink(struct Inode *inode)
+{
+    struct Inode **p = &g_inodes[hash_fcb(inode->fcb)];
+
+    while (*p != inode) {
+        p = &(*p)->next;
+    }
+    *p = inode->next;
+}
+
+static void inode_link(struct Inode *inode)
+{
+    uint32_t h = hash_fcb(inode->fcb);
+
+    inode->next = g_inodes[h];
+    g_inodes[h] = inode;
+}
+
+/**
+ * 引用计数减 1，最后一个引用消失时释放 inode，文件已被删除的话同时释放它的簇
+ */
+static void inode_put(struct Inode *inode)
+{
+    pthread_mutex_lock(&g_inode_lock);
+
+    int last = --inode->refcount == 0;
+    int orphan = inode->fcb == &inode->orphan;
+    if (last)
+        inode_unlink(inode);
+
+    pthread_mutex_unlock(&g_inode_lock);
+
+    if (!last)
+        return;
+
+    if (orphan)  // 已被删除
+        release_cluster(inode->orphan.first_cluster);
+
+    extent_map_clear(&inode->map);
+    pthread_rwlock_destroy(&inode->lock);
+    pthread_mutex_destroy(&inode->map_lock);
+    free(inode);
+}
+
+struct FileHandle *handle_open(struct FCB *fcb)
+{
+    struct FileHandle *fh = malloc(sizeof(struct FileHandle));
+    if (fh == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&g_inode_lock);
+
+    struct Inode *inode = find_locked(fcb);
+    if (inode == NULL) {
+        inode = calloc(1, sizeof(struct Inode));
+        if (inode == NULL) {
+            pthread_mutex_unlock(&g_inode_lock);
+            free(fh);
+            return NULL;
+        }
+
+        pthread_rwlock_init(&inode->lock, NULL);
+        pthread_mutex_init(&inode->map_lock, NULL);
+        inode->fcb = fcb;
+        inode->tail = CLUSTER_END;
+        extent_map_init(&inode->map);
+        inode_link(inode);
+    }
+
+    inode->refcount++;
+
+    pthread_mutex_unlock(&g_inode_lock);
+
+    fh->inode = inode;
+    fh->cursor = CURSOR_PACK(0, 0, CLUSTER_END);
+
+    return fh;
+}
+
+void handle_close(struct FileHandle *fh)
+{
+    struct Inode *inode = fh->inode;
+
+    free(fh);
+    inode_put(inode);
+}
+
+struct FileHandle *handle_of(const struct fuse_file_info *fi)
+{
+    if (fi == NULL)
+        return NULL;
+
+    return (struct FileHandle *) (uintptr_t) fi->fh;
+}
+
+/**
+ * 找到已打开的文件并持有一个引用，等锁期间文件可能被关闭
+ */
+static struct Inode *inode_get(const struct FCB *fcb)
+{
+    pthread_mutex_lock(&g_inode_lock);
+
+    struct Inode *inode = find_locked(fcb);
+    if (inode != NULL)
+        inode->refcount++;
+
+    pthread_mutex_unlock(&g_inode_lock);
+
+    return inode;
+}
+
+struct Inode *inode_lock(const struct FCB *fcb)
+{
+    struct Inode *inode = inode_get(fcb);
+    if (inode != NULL)
+        pthread_rwlock_wrlock(&inode->lock);
+
+    return inode;
+}
+
+struct Inode *inode_rdlock(const struct FCB *fcb)
+{
+    struct Inode *inode = inode_get(fcb);
+    if (inode != NULL)
+        pthread_rwlock_rdlock(&inode->lock);
+
+    return inode;
+}
+
+void inode_unlock(struct Inode *inode)
+{
+    if (inode == NULL)
+        return;
+
+    pthread_rwlock_unlock(&inode->lock);
+    inode_put(inode);
+}
+
+int inode_detach(struct FCB *fcb)
+{
+    struct Inode *inode = inode_lock(fcb);
+    if (inode == NULL)
+        return 0;
+
+    // 持有写锁，没有线程在读写目录项
+    memcpy(&inode->orphan, fcb, sizeof(struct FCB));
+
+    // 以拷贝的地址重新放回哈希表，通过句柄继续读写时 inode_find(inode->fcb) 仍能找到它
+    pthread_mutex_lock(&g_inode_lock);
+    inode_unlink(inode);
+    inode->fcb = &inode->orphan;
+    inode_link(inode);
+    pthread_mutex_unlock(&g_inode_lock);
+
+    inode_unlock(inode);
+
+    return 1;
+}
+
+void inode_move(const struct FCB *old_fcb, struct FCB *new_fcb)
+{
+    pthread_mutex_lock(&g_inode_lock);
+
+    struct Inode *inode = find_locked(old_fcb);
+    if (inode != NULL) {
+        inode_unlink(inode);
+        inode->fcb = new_fcb;
+        inode_link(inode);
+    }
+
+    pthread_mutex_unlock(&g_inode_lock);
+}
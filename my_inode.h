@@ -0,0 +1,102 @@
+//
+// 打开文件的内存状态
+//
+
+#ifndef MYFAT_MY_INODE_H
+#define MYFAT_MY_INODE_H
+
+#include "my_fat.h"
+#include "my_extent.h"
+
+#include <pthread.h>
+
+// 被打开文件的内存状态，同一个目录项的多次打开共享一个
+// 读文件持有 lock 的读锁，写文件、截断、删除和重命名持有写锁
+struct Inode {
+    pthread_rwlock_t lock;              // 文件的读写锁
+    pthread_mutex_t map_lock;           // 持有读锁时建立 map 用
+    struct FCB *fcb;                    // 目录项的位置
+    struct FCB orphan;                  // 文件被删除时仍处于打开状态，目录项拷贝到这里，最后一次关闭时再释放簇
+    uint32_t refcount;                  // 打开次数
+    uint32_t gen;                       // 簇链被截短时加 1，使各句柄缓存的游标失效
+    uint16_t tail;                      // 最后一个簇的簇号，CLUSTER_END 表示未知
+    uint32_t clusters;                  // 簇的数量，和 tail 一起维护，tail 未知时无效
+    struct ExtentMap map;               // 簇序号到簇号的映射，第一次随机访问时建立
+    struct Inode *next;                 // 哈希链表
+};
+
+// 游标打包成一个 64 位整数整体读写，同一个句柄上的并发读不会看到不一致的游标
+#define CURSOR_PACK(gen, index, cluster_num) \
+    (((uint64_t) (gen) << 32) | ((uint64_t) ((index) & 0xFFFF) << 16) | (uint16_t) (cluster_num))
+#define CURSOR_GEN(cursor) ((uint32_t) ((cursor) >> 32))
+#define CURSOR_INDEX(cursor) ((uint32_t) (((cursor) >> 16) & 0xFFFF))
+#define CURSOR_CLUSTER(cursor) ((uint16_t) (cursor))
+
+// fi->fh 指向的打开文件句柄
+struct FileHandle {
+    struct Inode *inode;
+    uint64_t cursor;                    // 游标：inode 的 gen、上次访问的是文件内第几个簇、对应的簇号
+};
+
+/**
+ * 打开文件，创建文件句柄
+ * @param fcb 文件的 FCB 结构体指针
+ * @return 成功返回文件句柄，失败返回 NULL
+ */
+struct FileHandle *handle_open(struct FCB *fcb);
+
+/**
+ * 关闭文件句柄，文件已被删除且是最后一次关闭时释放文件占用的簇
+ * @param fh 文件句柄
+ */
+void handle_close(struct FileHandle *fh);
+
+/**
+ * 从 fuse_file_info 中取出文件句柄
+ * @param fi fuse 传入的文件信息，可为 NULL
+ * @return 返回文件句柄，没有则返回 NULL
+ */
+struct FileHandle *handle_of(const struct fuse_file_info *fi);
+
+/**
+ * 查找目录项对应的打开文件
+ * @param fcb 文件的 FCB 结构体指针，也可以是已删除文件在 inode 里的目录项拷贝
+ * @return 文件没有被打开则返回 NULL
+ */
+struct Inode *inode_find(const struct FCB *fcb);
+
+/**
+ * 锁住已打开文件的写锁，文件没被打开时什么都不做
+ * @param fcb 文件的 FCB 结构体指针
+ * @return 返回加了写锁的 inode，需要用 inode_unlock 解锁；文件没有被打开则返回 NULL
+ */
+struct Inode *inode_lock(const struct FCB *fcb);
+
+/**
+ * 锁住已打开文件的读锁，文件没被打开时什么都不做
+ * @param fcb 文件的 FCB 结构体指针
+ * @return 返回加了读锁的 inode，需要用 inode_unlock 解锁；文件没有被打开则返回 NULL
+ */
+struct Inode *inode_rdlock(const struct FCB *fcb);
+
+/**
+ * 解开 inode_lock 或 inode_rdlock 加的锁
+ * @param inode inode_lock 或 inode_rdlock 的返回值，可为 NULL
+ */
+void inode_unlock(struct Inode *inode);
+
+/**
+ * 目录项即将被删除或覆盖，若文件仍被打开，则把目录项拷贝到 inode 里，文件继续可读写
+ * @param fcb 文件的 FCB 结构体指针
+ * @return 文件仍被打开返回 1，此时簇由最后一次关闭时释放；反之返回 0
+ */
+int inode_detach(struct FCB *fcb);
+
+/**
+ * 目录项被移动到新的位置（重命名），调用者需用 inode_lock 锁住文件
+ * @param old_fcb 原来的位置
+ * @param new_fcb 新的位置
+ */
+void inode_move(const struct FCB *old_fcb, struct FCB *new_fcb);
+
+#endif //MYFAT_MY_INODE_H
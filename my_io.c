@@ -0,0 +1,597 @@
+//
+// 镜像文件的读写引擎
+//
+
+#include "my_io.h"
+
+#include <fuse3/fuse.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// 每个线程的队列深度，也是同时在进行的请求数的上限
+#define RING_ENTRIES 64
+
+// 一个 sqe 最多读写的长度，长度字段只有 32 位
+#define MAX_IO_LEN (1u << 30)
+
+// 小批量的进度记录放在栈上
+#define STACK_REQUESTS 16
+
+// 分给工作线程时每块的大小，块的边界按这个大小在文件中对齐
+#define PIECE_SIZE (1u << 20)
+
+// 一批请求的总量达到这个大小才分给工作线程，小批量的同步开销比读写本身还大
+#define PARALLEL_MIN (4u << 20)
+
+enum {
+    ENGINE_SYNC,
+    ENGINE_URING,
+};
+
+// 一个 io_uring 实例，映射到用户态的提交队列和完成队列
+struct Ring {
+    int fd;
+    unsigned entries;               // 提交队列的项数
+
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    struct Ring *next;              // 所有线程的队列组成的链表
+};
+
+static int g_engine = ENGINE_SYNC;
+
+static struct Ring *g_rings;                // 所有线程的队列
+static pthread_mutex_t g_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t g_ring_key;            // 线程退出时释放它的队列
+static pthread_once_t g_ring_key_once = PTHREAD_ONCE_INIT;
+
+static __thread struct Ring *t_ring;        // 当前线程的队列
+static __thread int t_ring_failed;          // 当前线程创建队列失败，之后都同步读写
+
+// 分给工作线程的一批请求，放在调用者的栈上，调用者等全部完成才返回
+struct Job {
+    int fd;
+    struct IoRequest *pieces;       // 拆开后的块
+    size_t count;
+    size_t next;                    // 下一个没人领的块
+    size_t done;                    // 已经完成的块数
+    int ret;                        // 第一个出错的 -errno
+    struct Job *next_job;           // 还有块没领完的任务组成的队列
+};
+
+static pthread_t *g_workers;
+static unsigned g_worker_count;
+static int g_workers_stop;
+static struct Job *g_jobs;                  // 还有块没领完的任务，先来的在前
+static pthread_mutex_t g_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_pool_work = PTHREAD_COND_INITIALIZER;     // 有新任务或要停止
+static pthread_cond_t g_pool_done = PTHREAD_COND_INITIALIZER;     // 有任务全部完成
+
+static int sync_run(int fd, const struct IoRequest *reqs, size_t count)
+{
+    int ret = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const struct IoRequest *req = &reqs[i];
+        size_t done = 0;
+
+        while (done < req->len) {
+            ssize_t n;
+            if (req->write)
+                n = pwrite(fd, req->buf + done, req->len - done, req->pos + (off_t) done);
+            else
+                n = pread(fd, req->buf + done, req->len - done, req->pos + (off_t) done);
+
+            if (n < 0 && errno == EINTR)
+                continue;
+
+            if (n <= 0) {
+                // 读到文件末尾不算出错
+                if (ret == 0 && (n < 0 || req->write))
+                    ret = n < 0 ? -errno : -EIO;
+                break;
+            }
+
+            done += n;
+        }
+    }
+
+    return ret;
+}
+
+static void ring_free(struct Ring *ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+
+    close(ring->fd);
+    free(ring);
+}
+
+/**
+ * 检查内核是否支持 IORING_OP_READ 和 IORING_OP_WRITE
+ * 5.1 到 5.5 的内核能创建 io_uring，但这两个操作完成时返回 -EINVAL；它们和 IORING_REGISTER_PROBE 同在 5.6 加入，
+ * 不支持探测的内核也不支持它们
+ * @return 支持返回 1，反之返回 0
+ */
+static int ring_probe(int fd)
+{
+    size_t ops = IORING_OP_WRITE + 1;
+    struct io_uring_probe *probe = calloc(1, sizeof(struct io_uring_probe) + ops * sizeof(struct io_uring_probe_op));
+    if (probe == NULL)
+        return 0;
+
+    int supported = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, (unsigned) ops) == 0 &&
+                    probe->last_op >= IORING_OP_WRITE &&
+                    (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+                    (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+
+    free(probe);
+    return supported;
+}
+
+/**
+ * 创建一个 io_uring，并映射它的队列
+ * @return 成功返回队列，内核不支持（包括不支持需要的操作）或者被禁止时返回 NULL
+ */
+static struct Ring *ring_create(void)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = (int) syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (fd < 0)
+        return NULL;
+
+    if (!ring_probe(fd)) {
+        close(fd);
+        return NULL;
+    }
+
+    struct Ring *ring = calloc(1, sizeof(struct Ring));
+    if (ring == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    // 新内核的提交队列和完成队列可以一次映射
+    int single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring->cq_ring_size > ring->sq_ring_size)
+        ring->sq_ring_size = ring->cq_ring_size;
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+        goto fail;
+
+    if (single) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+            goto fail;
+    }
+
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                      IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto fail;
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    return ring;
+
+fail:
+    ring_free(ring);
+    return NULL;
+}
+
+/**
+ * 线程退出时释放它的队列；io_shutdown 已经释放过的不在链表里，跳过
+ */
+static void ring_release(void *arg)
+{
+    struct Ring *ring = arg;
+    int found = 0;
+
+    pthread_mutex_lock(&g_rings_lock);
+    for (struct Ring **p = &g_rings; *p != NULL; p = &(*p)->next) {
+        if (*p == ring) {
+            *p = ring->next;
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_rings_lock);
+
+    if (found)
+        ring_free(ring);
+}
+
+static void ring_key_create(void)
+{
+    pthread_key_create(&g_ring_key, ring_release);
+}
+
+/**
+ * 获取当前线程的队列，第一次调用时创建
+ * @return 创建失败返回 NULL，这个线程之后都同步读写
+ */
+static struct Ring *thread_ring(void)
+{
+    if (t_ring != NULL || t_ring_failed)
+        return t_ring;
+
+    t_ring = ring_create();
+    if (t_ring == NULL) {
+        t_ring_failed = 1;
+        fuse_log(FUSE_LOG_WARNING, "io: failed to set up io_uring, falling back to pread/pwrite\n");
+        return NULL;
+    }
+
+    pthread_once(&g_ring_key_once, ring_key_create);
+    pthread_setspecific(g_ring_key, t_ring);
+
+    pthread_mutex_lock(&g_rings_lock);
+    t_ring->next = g_rings;
+    g_rings = t_ring;
+    pthread_mutex_unlock(&g_rings_lock);
+
+    return t_ring;
+}
+
+/**
+ * 把请求中还没完成的部分放入提交队列
+ */
+static void ring_queue(struct Ring *ring, int fd, const struct IoRequest *req, size_t index, size_t done)
+{
+    // 只有当前线程会修改提交队列的尾部
+    unsigned tail = *ring->sq_tail;
+    unsigned slot = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+
+    size_t len = req->len - done;
+    if (len > MAX_IO_LEN)
+        len = MAX_IO_LEN;
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) (req->buf + done);
+    sqe->len = (uint32_t) len;
+    sqe->off = (uint64_t) req->pos + done;
+    sqe->user_data = index;
+
+    ring->sq_array[slot] = slot;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int uring_run(struct Ring *ring, int fd, const struct IoRequest *reqs, size_t count)
+{
+    size_t stack_done[STACK_REQUESTS];
+    size_t *done = count <= STACK_REQUESTS ? stack_done : calloc(count, sizeof(size_t));
+    if (done == NULL)
+        return sync_run(fd, reqs, count);
+    memset(done, 0, count * sizeof(size_t));
+
+    int ret = 0;
+    int failed = 0;             // io_uring_enter 出错后不再放入新的 sqe，只等已提交的完成
+    size_t next = 0;            // 下一个要提交的请求
+    unsigned inflight = 0;      // 已经放入队列、还没完成的请求数
+    unsigned to_submit = 0;     // 放入队列但还没提交给内核的 sqe 数
+
+    while ((!failed && next < count) || inflight > 0) {
+        // 队列有空位就继续放入新的请求
+        while (!failed && next < count && inflight < ring->entries) {
+            if (reqs[next].len > 0) {
+                ring_queue(ring, fd, &reqs[next], next, 0);
+                inflight++;
+                to_submit++;
+            }
+            next++;
+        }
+
+        if (inflight == 0)
+            break;
+
+        // 提交并等待至少一个完成
+        int n = (int) syscall(__NR_io_uring_enter, ring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n < 0) {
+            int err = errno;
+            if (err == EINTR || err == EAGAIN || err == EBUSY)
+                continue;
+
+            if (!failed) {
+                fuse_log(FUSE_LOG_ERR, "io: io_uring_enter failed: %d\n", -err);
+                failed = 1;
+                if (ret == 0)
+                    ret = -err;
+
+                // 内核还没取走的 sqe 收回来，对应的请求不再执行；只有当前线程会修改提交队列的尾部
+                __atomic_store_n(ring->sq_tail, *ring->sq_tail - to_submit, __ATOMIC_RELEASE);
+                inflight -= to_submit;
+                to_submit = 0;
+                continue;
+            }
+
+            // 已提交的请求还在使用缓冲区，等它们完成才能返回；队列本身已经不存在时没有可等的
+            if (err == EBADF)
+                break;
+            continue;
+        }
+        to_submit -= (unsigned) n;
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            size_t i = (size_t) cqe->user_data;
+            int res = cqe->res;
+            head++;
+
+            if (!failed && (res == -EAGAIN || res == -EINTR)) {  // 重新提交
+                ring_queue(ring, fd, &reqs[i], i, done[i]);
+                to_submit++;
+                continue;
+            }
+
+            if (res > 0)
+                done[i] += (size_t) res;
+
+            if (!failed && res > 0 && done[i] < reqs[i].len) {  // 不完整，继续读写剩下的部分
+                ring_queue(ring, fd, &reqs[i], i, done[i]);
+                to_submit++;
+                continue;
+            }
+
+            // 读到文件末尾不算出错
+            if (ret == 0 && (res < 0 || (res == 0 && reqs[i].write)))
+                ret = res < 0 ? res : -EIO;
+
+            inflight--;
+        }
+
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    if (done != stack_done)
+        free(done);
+
+    return ret;
+}
+
+/**
+ * 领走任务的下一块并完成它，持有 g_pool_lock 时调用，读写期间放开锁
+ */
+static void job_step(struct Job *job)
+{
+    struct IoRequest *piece = &job->pieces[job->next++];
+
+    // 最后一块被领走后任务离开队列，调用者领的可能不在队首
+    if (job->next == job->count) {
+        struct Job **p = &g_jobs;
+        while (*p != job)
+            p = &(*p)->next_job;
+        *p = job->next_job;
+    }
+
+    pthread_mutex_unlock(&g_pool_lock);
+    int err = sync_run(job->fd, piece, 1);
+    pthread_mutex_lock(&g_pool_lock);
+
+    if (err != 0 && job->ret == 0)
+        job->ret = err;
+
+    if (++job->done == job->count)
+        pthread_cond_broadcast(&g_pool_done);
+}
+
+static void *worker_thread(void *arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&g_pool_lock);
+    while (!g_workers_stop) {
+        if (g_jobs != NULL)
+            job_step(g_jobs);
+        else
+            pthread_cond_wait(&g_pool_work, &g_pool_lock);
+    }
+    pthread_mutex_unlock(&g_pool_lock);
+
+    return NULL;
+}
+
+/**
+ * 把请求按 PIECE_SIZE 对齐拆开，交给工作线程，调用者也一起读写，全部完成后返回
+ * @return 全部成功返回 0，反之返回某个出错的 -errno；内存不足时返回 1，由调用者自己读写
+ */
+static int parallel_run(int fd, const struct IoRequest *reqs, size_t count)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (reqs[i].len > 0)
+            total += (size_t) ((reqs[i].pos + (off_t) reqs[i].len - 1) / PIECE_SIZE - reqs[i].pos / PIECE_SIZE) + 1;
+    }
+
+    struct Job job = {fd, malloc(total * sizeof(struct IoRequest)), 0, 0, 0, 0, NULL};
+    if (job.pieces == NULL)
+        return 1;
+
+    for (size_t i = 0; i < count; i++) {
+        for (size_t done = 0; done < reqs[i].len;) {
+            off_t pos = reqs[i].pos + (off_t) done;
+            size_t len = PIECE_SIZE - (size_t) (pos % PIECE_SIZE);
+            if (len > reqs[i].len - done)
+                len = reqs[i].len - done;
+
+            struct IoRequest *piece = &job.pieces[job.count++];
+            piece->buf = reqs[i].buf + done;
+            piece->len = len;
+            piece->pos = pos;
+            piece->write = reqs[i].write;
+            done += len;
+        }
+    }
+
+    pthread_mutex_lock(&g_pool_lock);
+
+    struct Job **tail = &g_jobs;
+    while (*tail != NULL)
+        tail = &(*tail)->next_job;
+    *tail = &job;
+    pthread_cond_broadcast(&g_pool_work);
+
+    // 调用者不闲着，和工作线程一起领块
+    while (job.next < job.count)
+        job_step(&job);
+
+    while (job.done < job.count)
+        pthread_cond_wait(&g_pool_done, &g_pool_lock);
+
+    pthread_mutex_unlock(&g_pool_lock);
+
+    free(job.pieces);
+    return job.ret;
+}
+
+/**
+ * 停止所有工作线程，这时不能有任务在进行
+ */
+static void workers_stop(void)
+{
+    pthread_mutex_lock(&g_pool_lock);
+    g_workers_stop = 1;
+    pthread_cond_broadcast(&g_pool_work);
+    pthread_mutex_unlock(&g_pool_lock);
+
+    for (unsigned i = 0; i < g_worker_count; i++)
+        pthread_join(g_workers[i], NULL);
+
+    free(g_workers);
+    g_workers = NULL;
+    g_worker_count = 0;
+    g_workers_stop = 0;
+}
+
+int io_set_workers(unsigned threads)
+{
+    workers_stop();
+
+    if (threads == 0)
+        return 0;
+
+    g_workers = malloc(threads * sizeof(pthread_t));
+    if (g_workers == NULL)
+        return -ENOMEM;
+
+    for (; g_worker_count < threads; g_worker_count++) {
+        int err = pthread_create(&g_workers[g_worker_count], NULL, worker_thread, NULL);
+        if (err != 0)
+            return -err;
+    }
+
+    return 0;
+}
+
+int io_set_engine(const char *name)
+{
+    if (name == NULL || strcmp(name, "sync") == 0) {
+        g_engine = ENGINE_SYNC;
+        return 0;
+    }
+
+    if (strcmp(name, "uring") != 0)
+        return -1;
+
+    // 先在当前线程试一下，内核不支持就直接用同步读写
+    g_engine = thread_ring() != NULL ? ENGINE_URING : ENGINE_SYNC;
+    return 0;
+}
+
+const char *io_engine_name(void)
+{
+    return g_engine == ENGINE_URING ? "uring" : "sync";
+}
+
+int io_run(int fd, const struct IoRequest *reqs, size_t count)
+{
+    if (count == 0)
+        return 0;
+
+    // 单个请求没有可以合并提交的，直接同步读写省掉一次系统调用
+    struct Ring *ring = g_engine == ENGINE_URING && count > 1 ? thread_ring() : NULL;
+    if (ring == NULL) {
+        size_t total = 0;
+        for (size_t i = 0; i < count; i++)
+            total += reqs[i].len;
+
+        int ret;
+        if (g_worker_count > 0 && total >= PARALLEL_MIN && (ret = parallel_run(fd, reqs, count)) <= 0)
+            return ret;
+
+        return sync_run(fd, reqs, count);
+    }
+
+    return uring_run(ring, fd, reqs, count);
+}
+
+void io_shutdown(void)
+{
+    pthread_mutex_lock(&g_rings_lock);
+    struct Ring *ring = g_rings;
+    g_rings = NULL;
+    pthread_mutex_unlock(&g_rings_lock);
+
+    while (ring != NULL) {
+        struct Ring *next = ring->next;
+        ring_free(ring);
+        ring = next;
+    }
+
+    t_ring = NULL;
+    t_ring_failed = 0;
+
+    workers_stop();
+}
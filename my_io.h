@@ -0,0 +1,59 @@
+//
+// 镜像文件的读写引擎：同步的 pread/pwrite，或者用 io_uring 批量提交
+//
+
+#ifndef MYFAT_MY_IO_H
+#define MYFAT_MY_IO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// 一次读或写
+struct IoRequest {
+    char *buf;                  // 内存中的缓冲区
+    size_t len;                 // 长度
+    off_t pos;                  // 在文件中的偏移
+    int write;                  // 为 1 则写入文件，为 0 则从文件读出
+};
+
+/**
+ * 选择读写引擎，在第一次读写之前调用
+ * io_uring 不可用（内核不支持、被禁止，或者是不支持 IORING_OP_READ/WRITE 的 5.6 之前的内核）时退回到同步读写
+ * @param name "sync" 或 "uring"，为 NULL 则使用同步读写
+ * @return 成功返回 0，不认识的引擎名返回 -1
+ */
+int io_set_engine(const char *name);
+
+/**
+ * 设置同步读写的工作线程数：总量较大的一批请求按对齐的块拆开，由工作线程和调用者一起 pread/pwrite
+ * io_uring 引擎不使用工作线程，内核本身会并发处理一批请求
+ * @param threads 工作线程数，为 0 则只由调用者读写
+ * @return 成功返回 0，创建线程失败返回 -errno，已经创建的线程照常工作
+ */
+int io_set_workers(unsigned threads);
+
+/**
+ * 当前使用的引擎
+ * @return 返回引擎名
+ */
+const char *io_engine_name(void);
+
+/**
+ * 执行一批读写，返回时全部完成
+ * io_uring 引擎下一次提交多个请求，同时在进行的请求数受队列深度限制，读写不完整的请求会继续提交剩下的部分
+ * 同步读写时总量较大的一批请求分给工作线程并行完成
+ * 读到文件末尾时缓冲区剩下的部分保持原样
+ * 可以被多个线程同时调用，每个线程使用自己的队列
+ * @param fd 文件描述符
+ * @param reqs 请求数组
+ * @param count 请求数
+ * @return 全部成功返回 0，反之返回第一个出错的 -errno
+ */
+int io_run(int fd, const struct IoRequest *reqs, size_t count);
+
+/**
+ * 释放所有线程的队列并停止工作线程，此时不能有其他线程在读写
+ */
+void io_shutdown(void);
+
+#endif //MYFAT_MY_IO_H
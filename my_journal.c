@@ -0,0 +1,389 @@
+//
+// 元数据的预写日志
+//
+
+#include "my_journal.h"
+#include "my_io.h"
+
+#include <fuse3/fuse.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define JOURNAL_MAGIC "MYFATJNL"
+#define TXN_MAGIC "MYFATTXN"
+#define JOURNAL_VERSION 1
+
+// 日志文件开头的日志头，占一个块
+struct JournalHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;                // 记录的粒度，等于 JOURNAL_BLOCK_SIZE
+    uint64_t image_size;                // 镜像大小
+    uint64_t sequence;                  // 第一个事务的序号，之后的事务依次加 1
+}__attribute__((packed));
+
+// 每个事务的开头，后面紧跟 count 个块号，补齐到块大小，再之后是 count 个块的内容
+struct TxnHeader {
+    char magic[8];
+    uint64_t sequence;                  // 事务序号，清空日志后残留的旧事务对不上序号
+    uint32_t count;                     // 块数
+    uint32_t checksum;                  // 整个事务的 CRC32，计算时这个字段为 0
+}__attribute__((packed));
+
+static int g_journal_fd = -1;
+static uint64_t g_journal_end;          // 下一个事务写入的位置
+static uint64_t g_sequence;             // 下一个事务的序号
+static uint64_t g_image_size;
+static char *g_txn_buf;                 // 事务头的缓冲区，按需扩大
+static size_t g_txn_buf_size;
+
+static uint32_t g_crc_table[256];
+
+static void crc_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        g_crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    crc = ~crc;
+    while (len-- > 0)
+        crc = g_crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+/**
+ * 事务头加上块号占用的大小，补齐到块大小
+ */
+static size_t txn_header_size(size_t count)
+{
+    size_t len = sizeof(struct TxnHeader) + count * sizeof(uint64_t);
+    return (len + JOURNAL_BLOCK_SIZE - 1) / JOURNAL_BLOCK_SIZE * JOURNAL_BLOCK_SIZE;
+}
+
+static uint32_t txn_checksum(char *head, size_t head_size, const char *data, size_t count)
+{
+    struct TxnHeader *txn = (struct TxnHeader *) head;
+    uint32_t saved = txn->checksum;
+
+    txn->checksum = 0;
+    uint32_t crc = crc32(crc32(0, head, head_size), data, count * JOURNAL_BLOCK_SIZE);
+    txn->checksum = saved;
+
+    return crc;
+}
+
+static int read_exact(int fd, void *buf, size_t len, off_t pos)
+{
+    struct IoRequest req = {buf, len, pos, 0};
+    return io_run(fd, &req, 1);
+}
+
+/**
+ * 把一个事务的块写到镜像文件里，相邻的块合并成一次写入
+ * @return 成功返回 0，失败返回 -errno
+ */
+static int apply_txn(int image_fd, const uint64_t *blocks, char *data, size_t count)
+{
+    struct IoRequest *reqs = malloc(count * sizeof(struct IoRequest));
+    if (reqs == NULL)
+        return -ENOMEM;
+
+    size_t nreqs = 0;
+    for (size_t i = 0; i < count; i++) {
+        off_t pos = (off_t) (blocks[i] * JOURNAL_BLOCK_SIZE);
+        struct IoRequest *last = nreqs > 0 ? &reqs[nreqs - 1] : NULL;
+
+        if (last != NULL && last->pos + (off_t) last->len == pos) {
+            last->len += JOURNAL_BLOCK_SIZE;
+        } else {
+            reqs[nreqs].buf = data + i * JOURNAL_BLOCK_SIZE;
+            reqs[nreqs].len = JOURNAL_BLOCK_SIZE;
+            reqs[nreqs].pos = pos;
+            reqs[nreqs].write = 1;
+            nreqs++;
+        }
+    }
+
+    int ret = io_run(image_fd, reqs, nreqs);
+    free(reqs);
+
+    return ret;
+}
+
+/**
+ * 依次重放日志里的事务，遇到第一个不完整的事务为止
+ * @return 成功返回 0，失败返回 -errno
+ */
+static int replay_txns(int fd, uint64_t file_size, const struct JournalHeader *header, int image_fd,
+                       size_t *replayed)
+{
+    uint64_t pos = JOURNAL_BLOCK_SIZE;
+    uint64_t sequence = header->sequence;
+    int ret = 0;
+
+    while (pos + JOURNAL_BLOCK_SIZE <= file_size) {
+        struct TxnHeader txn;
+        ret = read_exact(fd, &txn, sizeof(txn), (off_t) pos);
+        if (ret != 0)
+            break;
+
+        if (memcmp(txn.magic, TXN_MAGIC, sizeof(txn.magic)) != 0 || txn.sequence != sequence || txn.count == 0)
+            break;
+
+        size_t head_size = txn_header_size(txn.count);
+        uint64_t data_size = (uint64_t) txn.count * JOURNAL_BLOCK_SIZE;
+        if (pos + head_size + data_size > file_size)
+            break;
+
+        char *buf = malloc(head_size + data_size);
+        if (buf == NULL) {
+            ret = -ENOMEM;
+            break;
+        }
+
+        ret = read_exact(fd, buf, head_size + data_size, (off_t) pos);
+        if (ret != 0) {
+            free(buf);
+            break;
+        }
+
+        char *data = buf + head_size;
+        if (txn_checksum(buf, head_size, data, txn.count) != txn.checksum) {
+            free(buf);
+            break;
+        }
+
+        // 校验和对得上但块号越界说明日志和镜像不匹配，不能继续
+        const uint64_t *blocks = (const uint64_t *) (buf + sizeof(struct TxnHeader));
+        for (uint32_t i = 0; i < txn.count; i++) {
+            if ((blocks[i] + 1) * JOURNAL_BLOCK_SIZE > header->image_size || (i > 0 && blocks[i] <= blocks[i - 1]))
+                ret = -EINVAL;
+        }
+
+        if (ret == 0)
+            ret = apply_txn(image_fd, blocks, data, txn.count);
+
+        free(buf);
+
+        if (ret != 0)
+            break;
+
+        pos += head_size + data_size;
+        sequence++;
+        (*replayed)++;
+    }
+
+    return ret;
+}
+
+int journal_replay(const char *path, const char *image, size_t *replayed)
+{
+    *replayed = 0;
+    crc_init();
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -errno;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int ret = -errno;
+        close(fd);
+        return ret;
+    }
+
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+
+    struct JournalHeader header;
+    memset(&header, 0, sizeof(header));
+    int ret = read_exact(fd, &header, sizeof(header), 0);
+    if (ret == 0 && (memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0 ||
+                     header.version != JOURNAL_VERSION || header.block_size != JOURNAL_BLOCK_SIZE)) {
+        fuse_log(FUSE_LOG_ERR, "journal: %s is not a journal\n", path);
+        ret = -EINVAL;
+    }
+
+    int image_fd = -1;
+    if (ret == 0) {
+        image_fd = open(image, O_RDWR);
+        if (image_fd < 0)
+            ret = -errno;
+    }
+
+    struct stat image_st;
+    if (ret == 0 && fstat(image_fd, &image_st) != 0)
+        ret = -errno;
+
+    if (ret == 0 && (uint64_t) image_st.st_size < header.image_size) {
+        fuse_log(FUSE_LOG_ERR, "journal: %s does not belong to %s\n", path, image);
+        ret = -EINVAL;
+    }
+
+    if (ret == 0)
+        ret = replay_txns(fd, (uint64_t) st.st_size, &header, image_fd, replayed);
+
+    // 重放的内容落盘之后日志才能被清空
+    if (ret == 0 && *replayed > 0 && fdatasync(image_fd) != 0)
+        ret = -errno;
+
+    if (image_fd >= 0)
+        close(image_fd);
+    close(fd);
+
+    return ret;
+}
+
+/**
+ * 写入新的日志头并截掉之前的事务，新的序号和残留的旧事务对不上
+ * @return 成功返回 0，失败返回 -errno
+ */
+static int write_header(void)
+{
+    struct JournalHeader *header = (struct JournalHeader *) g_txn_buf;
+    memset(g_txn_buf, 0, JOURNAL_BLOCK_SIZE);
+    memcpy(header->magic, JOURNAL_MAGIC, sizeof(header->magic));
+    header->version = JOURNAL_VERSION;
+    header->block_size = JOURNAL_BLOCK_SIZE;
+    header->image_size = g_image_size;
+    header->sequence = g_sequence;
+
+    struct IoRequest req = {g_txn_buf, JOURNAL_BLOCK_SIZE, 0, 1};
+    int ret = io_run(g_journal_fd, &req, 1);
+
+    if (ret == 0 && ftruncate(g_journal_fd, JOURNAL_BLOCK_SIZE) != 0)
+        ret = -errno;
+
+    if (ret == 0 && fdatasync(g_journal_fd) != 0)
+        ret = -errno;
+
+    if (ret == 0)
+        g_journal_end = JOURNAL_BLOCK_SIZE;
+
+    return ret;
+}
+
+int journal_open(const char *path, uint64_t image_size)
+{
+    crc_init();
+
+    g_txn_buf = malloc(JOURNAL_BLOCK_SIZE);
+    if (g_txn_buf == NULL)
+        return -ENOMEM;
+    g_txn_buf_size = JOURNAL_BLOCK_SIZE;
+
+    g_journal_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (g_journal_fd < 0) {
+        int ret = -errno;
+        free(g_txn_buf);
+        g_txn_buf = NULL;
+        return ret;
+    }
+
+    // 每次打开用不同的起始序号，上一次没截断干净的事务不会被当成这次的
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    g_sequence = (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+    g_image_size = image_size;
+
+    int ret = write_header();
+    if (ret != 0)
+        journal_close();
+
+    return ret;
+}
+
+int journal_is_open(void)
+{
+    return g_journal_fd >= 0;
+}
+
+int journal_append(const size_t *blocks, const char *data, size_t count, int sync)
+{
+    if (count == 0)
+        return 0;
+
+    size_t head_size = txn_header_size(count);
+    if (head_size > g_txn_buf_size) {
+        char *buf = realloc(g_txn_buf, head_size);
+        if (buf == NULL)
+            return -ENOMEM;
+        g_txn_buf = buf;
+        g_txn_buf_size = head_size;
+    }
+
+    memset(g_txn_buf, 0, head_size);
+    struct TxnHeader *txn = (struct TxnHeader *) g_txn_buf;
+    memcpy(txn->magic, TXN_MAGIC, sizeof(txn->magic));
+    txn->sequence = g_sequence;
+    txn->count = (uint32_t) count;
+
+    uint64_t *numbers = (uint64_t *) (g_txn_buf + sizeof(struct TxnHeader));
+    for (size_t i = 0; i < count; i++)
+        numbers[i] = blocks[i];
+
+    txn->checksum = txn_checksum(g_txn_buf, head_size, data, count);
+
+    // 事务头和内容一起提交，校验和保证重放时只认完整写入的事务
+    struct IoRequest reqs[2] = {
+            {g_txn_buf, head_size, (off_t) g_journal_end, 1},
+            {(char *) data, count * JOURNAL_BLOCK_SIZE, (off_t) (g_journal_end + head_size), 1},
+    };
+    int ret = io_run(g_journal_fd, reqs, 2);
+
+    if (ret == 0 && sync && fdatasync(g_journal_fd) != 0)
+        ret = -errno;
+
+    if (ret != 0) {
+        // 截掉写了一半的事务，后面追加的事务才能被重放
+        if (ftruncate(g_journal_fd, (off_t) g_journal_end) != 0)
+            fuse_log(FUSE_LOG_ERR, "journal: failed to drop a partial transaction\n");
+        return ret;
+    }
+
+    g_journal_end += head_size + count * JOURNAL_BLOCK_SIZE;
+    g_sequence++;
+
+    return 0;
+}
+
+uint64_t journal_size(void)
+{
+    return g_journal_end;
+}
+
+int journal_reset(void)
+{
+    if (g_journal_fd < 0 || g_journal_end == JOURNAL_BLOCK_SIZE)
+        return 0;
+
+    return write_header();
+}
+
+void journal_close(void)
+{
+    if (g_journal_fd >= 0)
+        close(g_journal_fd);
+
+    free(g_txn_buf);
+    g_txn_buf = NULL;
+    g_txn_buf_size = 0;
+    g_journal_fd = -1;
+    g_journal_end = 0;
+}
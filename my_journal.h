@@ -0,0 +1,64 @@
+//
+// 元数据的预写日志：修改过的 FAT 和目录扇区先追加到镜像旁边的日志文件，再写回镜像
+//
+
+#ifndef MYFAT_MY_JOURNAL_H
+#define MYFAT_MY_JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// 日志记录的粒度
+#define JOURNAL_BLOCK_SIZE 512
+
+/**
+ * 把日志里完整提交的事务重放到镜像文件，在挂载读取引导扇区之前调用
+ * 校验和不对的事务（追加到一半时崩溃）和它之后的内容被忽略
+ * @param path 日志文件路径，不存在或为空则什么都不做
+ * @param image 镜像文件路径
+ * @param replayed 保存重放的事务数
+ * @return 成功返回 0，日志头损坏或读写失败返回 -errno
+ */
+int journal_replay(const char *path, const char *image, size_t *replayed);
+
+/**
+ * 创建或清空日志文件，之后可以追加事务
+ * @param path 日志文件路径
+ * @param image_size 镜像大小，记录在日志头里，重放时校验
+ * @return 成功返回 0，失败返回 -errno
+ */
+int journal_open(const char *path, uint64_t image_size);
+
+/**
+ * 日志是否已经打开
+ * @return 打开了返回 1，反之返回 0
+ */
+int journal_is_open(void);
+
+/**
+ * 追加一个事务，返回时整个事务已经写入日志文件
+ * @param blocks 每个块在镜像中的序号（以 JOURNAL_BLOCK_SIZE 为单位），从小到大
+ * @param data 块的内容，按 blocks 的顺序连续存放
+ * @param count 块数
+ * @param sync 为 1 则等待日志落盘，这是事务提交的时刻
+ * @return 成功返回 0，失败返回 -errno，失败的事务不会被重放
+ */
+int journal_append(const size_t *blocks, const char *data, size_t count, int sync);
+
+/**
+ * 日志文件当前的大小
+ */
+uint64_t journal_size(void);
+
+/**
+ * 清空日志，只能在日志里的内容都已经写回镜像并落盘之后调用
+ * @return 成功返回 0，失败返回 -errno
+ */
+int journal_reset(void);
+
+/**
+ * 关闭日志文件，里面的内容保留，下次挂载时重放
+ */
+void journal_close(void);
+
+#endif //MYFAT_MY_JOURNAL_H
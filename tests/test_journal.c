@@ -0,0 +1,186 @@
+//
+// 日志重放：完整的事务被重放，写了一半、校验和不对、序号对不上的事务和它之后的内容被忽略
+//
+
+#include "my_journal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define IMAGE "test_journal.img"
+#define JOURNAL "test_journal.img.journal"
+#define IMAGE_BLOCKS 64
+#define IMAGE_SIZE (IMAGE_BLOCKS * JOURNAL_BLOCK_SIZE)
+
+static int g_failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        g_failures++; \
+    } \
+} while (0)
+
+// 三个事务：块 1、2 写 'A'，块 3 写 'B'，块 5 写 'C'
+static const size_t g_blocks1[] = {1, 2};
+static const size_t g_blocks2[] = {3};
+static const size_t g_blocks3[] = {5};
+
+static void reset_image(void)
+{
+    static char zero[IMAGE_SIZE];
+
+    int fd = open(IMAGE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd >= 0 && pwrite(fd, zero, sizeof(zero), 0) == (ssize_t) sizeof(zero));
+    close(fd);
+}
+
+/**
+ * 镜像中的块是否全是 c
+ */
+static int block_is(size_t block, char c)
+{
+    char buf[JOURNAL_BLOCK_SIZE];
+
+    int fd = open(IMAGE, O_RDONLY);
+    ssize_t n = pread(fd, buf, sizeof(buf), (off_t) (block * JOURNAL_BLOCK_SIZE));
+    close(fd);
+
+    if (n != (ssize_t) sizeof(buf))
+        return 0;
+
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        if (buf[i] != c)
+            return 0;
+    }
+
+    return 1;
+}
+
+static void append(const size_t *blocks, size_t count, char c)
+{
+    char *data = malloc(count * JOURNAL_BLOCK_SIZE);
+    memset(data, c, count * JOURNAL_BLOCK_SIZE);
+    CHECK(journal_append(blocks, data, count, 1) == 0);
+    free(data);
+}
+
+/**
+ * 写一个含三个事务的日志，返回每个事务结束时日志的大小
+ */
+static void write_journal(uint64_t ends[3])
+{
+    CHECK(journal_open(JOURNAL, IMAGE_SIZE) == 0);
+    append(g_blocks1, 2, 'A');
+    ends[0] = journal_size();
+    append(g_blocks2, 1, 'B');
+    ends[1] = journal_size();
+    append(g_blocks3, 1, 'C');
+    ends[2] = journal_size();
+    journal_close();
+}
+
+static size_t replay(int expect_ret)
+{
+    size_t replayed = 0;
+    CHECK(journal_replay(JOURNAL, IMAGE, &replayed) == expect_ret);
+    return replayed;
+}
+
+static void test_complete(void)
+{
+    uint64_t ends[3];
+
+    reset_image();
+    write_journal(ends);
+    CHECK(replay(0) == 3);
+    CHECK(block_is(1, 'A') && block_is(2, 'A') && block_is(3, 'B') && block_is(5, 'C'));
+    CHECK(block_is(0, 0) && block_is(4, 0));
+}
+
+static void test_torn(void)
+{
+    uint64_t ends[3];
+
+    // 最后一个事务只写进去一半
+    reset_image();
+    write_journal(ends);
+    CHECK(truncate(JOURNAL, (off_t) (ends[2] - JOURNAL_BLOCK_SIZE / 2)) == 0);
+    CHECK(replay(0) == 2);
+    CHECK(block_is(1, 'A') && block_is(3, 'B') && block_is(5, 0));
+}
+
+static void test_bad_checksum(void)
+{
+    uint64_t ends[3];
+
+    // 第二个事务的内容坏了，它和之后的事务都不重放
+    reset_image();
+    write_journal(ends);
+    int fd = open(JOURNAL, O_RDWR);
+    CHECK(pwrite(fd, "x", 1, (off_t) (ends[1] - 1)) == 1);
+    close(fd);
+    CHECK(replay(0) == 1);
+    CHECK(block_is(1, 'A') && block_is(3, 0) && block_is(5, 0));
+}
+
+static void test_stale_sequence(void)
+{
+    uint64_t ends[3];
+
+    // 保存旧日志里后两个事务的内容
+    reset_image();
+    write_journal(ends);
+    size_t stale_size = ends[2] - ends[0];
+    char *stale = malloc(stale_size);
+    int fd = open(JOURNAL, O_RDONLY);
+    CHECK(pread(fd, stale, stale_size, (off_t) ends[0]) == (ssize_t) stale_size);
+    close(fd);
+
+    // 重新打开的日志用新的序号，写一个同样大小的事务，再把旧事务接在后面，模拟清空前残留的内容
+    CHECK(journal_open(JOURNAL, IMAGE_SIZE) == 0);
+    append(g_blocks1, 2, 'D');
+    CHECK(journal_size() == ends[0]);
+    journal_close();
+
+    fd = open(JOURNAL, O_RDWR);
+    CHECK(pwrite(fd, stale, stale_size, (off_t) ends[0]) == (ssize_t) stale_size);
+    close(fd);
+    free(stale);
+
+    CHECK(replay(0) == 1);
+    CHECK(block_is(1, 'D') && block_is(2, 'D') && block_is(3, 0) && block_is(5, 0));
+}
+
+static void test_not_a_journal(void)
+{
+    reset_image();
+
+    int fd = open(JOURNAL, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    char junk[JOURNAL_BLOCK_SIZE];
+    memset(junk, 'J', sizeof(junk));
+    CHECK(pwrite(fd, junk, sizeof(junk), 0) == (ssize_t) sizeof(junk));
+    close(fd);
+
+    CHECK(replay(-EINVAL) == 0);
+    CHECK(block_is(0, 0));
+}
+
+int main(void)
+{
+    test_complete();
+    test_torn();
+    test_bad_checksum();
+    test_stale_sequence();
+    test_not_a_journal();
+
+    unlink(JOURNAL);
+    unlink(IMAGE);
+
+    return g_failures == 0 ? 0 : 1;
+}
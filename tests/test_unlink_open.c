@@ -0,0 +1,99 @@
+//
+// 删除仍被打开的文件后，通过句柄继续写、截断和预分配
+//
+
+#define _GNU_SOURCE     // FALLOC_FL_*
+
+#include "my_fat.h"
+#include "my_alloc.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#define IMAGE "test_unlink_open.img"
+#define CHUNK (64 * 1024)
+
+static int g_failures;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        g_failures++; \
+    } \
+} while (0)
+
+static char g_buf[4 * CHUNK];
+static char g_back[4 * CHUNK];
+
+static void fill(char *buf, size_t len, int seed)
+{
+    for (size_t i = 0; i < len; i++)
+        buf[i] = (char) (i * 31 + seed + (i >> 12));
+}
+
+int main(void)
+{
+    struct fuse_conn_info conn;
+    struct fuse_config cfg;
+
+    opts.filename = IMAGE;
+    opts.is_create = 1;
+    opts.size_mb = 16;
+    opts.cluster_size = 4096;
+    my_init(&conn, &cfg);
+
+    uint32_t free_count = alloc_free_count();
+
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof(fi));
+    CHECK(my_create("/a", 0644, &fi) == 0);
+    fill(g_buf, CHUNK, 1);
+    CHECK(my_write("/a", g_buf, CHUNK, 0, &fi) == CHUNK);
+
+    // 随机访问一次，建立簇的映射
+    CHECK(my_read("/a", g_back, 100, CHUNK / 2, &fi) == 100);
+    CHECK(my_unlink("/a") == 0);
+
+    // 文件变长后随机访问新的簇
+    fill(g_buf, sizeof(g_buf), 2);
+    CHECK(my_write("/a", g_buf, sizeof(g_buf), 1 << 20, &fi) == sizeof(g_buf));
+    CHECK(my_read("/a", g_back, 5000, (1 << 20) + 3 * CHUNK, &fi) == 5000);
+    CHECK(memcmp(g_back, g_buf + 3 * CHUNK, 5000) == 0);
+    CHECK(my_read("/a", g_back, 5000, (1 << 20) + 100, &fi) == 5000);
+    CHECK(memcmp(g_back, g_buf + 100, 5000) == 0);
+
+    // 截短后释放的簇被另一个文件占用，再通过句柄写不能改到它
+    CHECK(my_truncate("/a", 8192, &fi) == 0);
+    struct fuse_file_info other;
+    memset(&other, 0, sizeof(other));
+    CHECK(my_create("/b", 0644, &other) == 0);
+    fill(g_buf, sizeof(g_buf), 3);
+    CHECK(my_write("/b", g_buf, sizeof(g_buf), 0, &other) == sizeof(g_buf));
+
+    static char data[3 * CHUNK];
+    fill(data, sizeof(data), 4);
+    CHECK(my_write("/a", data, sizeof(data), 4096, &fi) == sizeof(data));
+    CHECK(my_read("/a", g_back, sizeof(data), 4096, &fi) == sizeof(data));
+    CHECK(memcmp(g_back, data, sizeof(data)) == 0);
+    CHECK(my_read("/b", g_back, sizeof(g_buf), 0, &other) == sizeof(g_buf));
+    CHECK(memcmp(g_back, g_buf, sizeof(g_buf)) == 0);
+
+    // 预分配和打洞同样作用在已删除的文件上
+    CHECK(my_fallocate("/a", 0, 0, 1 << 20, &fi) == 0);
+    CHECK(my_read("/a", g_back, 100, (1 << 20) - 100, &fi) == 100);
+    CHECK(my_fallocate("/a", FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 4096, CHUNK, &fi) == 0);
+    CHECK(my_read("/a", g_back, 100, 4096, &fi) == 100 && g_back[0] == 0 && g_back[99] == 0);
+    CHECK(my_read("/b", g_back, sizeof(g_buf), 0, &other) == sizeof(g_buf));
+    CHECK(memcmp(g_back, g_buf, sizeof(g_buf)) == 0);
+
+    // 最后一次关闭时释放已删除文件的所有簇
+    my_release("/a", &fi);
+    my_release("/b", &other);
+    CHECK(my_unlink("/b") == 0);
+    CHECK(alloc_free_count() == free_count);
+
+    my_destroy(NULL);
+    unlink(IMAGE);
+
+    return g_failures == 0 ? 0 : 1;
+}